@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "sprite_nodes/CCMeshFileInfo.h"
 #include "ccMacros.h"
 #include "platform/CCFileUtils.h"
+#include "textures/CCTextureCache.h"
 #include <algorithm>
 
 NS_CC_BEGIN
@@ -64,6 +65,17 @@ CCMeshImageInfo* CCMeshFileInfo::getImage(const char* image_name)
 	return NULL;
 }
 
+CCTexture2D* CCMeshFileInfo::addTexture(const char* filename, const std::string& format)
+{
+	// RGB565 pages are saved with opaque alpha and converted on uploading, RGB888 ones have no alpha
+	CCTexture2DPixelFormat alpha_format = CCTexture2D::defaultAlphaPixelFormat();
+	if (format == "RGB565")
+		CCTexture2D::setDefaultAlphaPixelFormat(kCCTexture2DPixelFormat_RGB565);
+	CCTexture2D* texture = CCTextureCache::sharedTextureCache()->addImage(filename);
+	CCTexture2D::setDefaultAlphaPixelFormat(alpha_format);
+	return texture;
+}
+
 CCMeshXMLParser::CCMeshXMLParser()
 	: m_images(NULL)
 	, m_processing_image(NULL)
@@ -122,10 +134,22 @@ void CCMeshXMLParser::startElement(void *ctx, const char *name, const char **att
 		slice.size.width = _propertiesInt(props, "width");
 		slice.size.height = _propertiesInt(props, "height");
 		slice.rotated = _propertiesBool(props, "rotate");
+		slice.flip_x = _propertiesBool(props, "flip_x");
+		slice.flip_y = _propertiesBool(props, "flip_y");
+		slice.opaque = _propertiesBool(props, "opaque");
+		if (_propertiesExist(props, "color"))
+		{
+			// #RRGGBBAA
+			unsigned int color = strtoul(props["color"].c_str() + 1, NULL, 16);
+			slice.has_color = true;
+			slice.color = ccc4((color >> 24) & 0xFF, (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF);
+		}
 
-		if (m_processing_image->id2tex.find(slice.texture_id) == m_processing_image->id2tex.end())
+		if (!slice.has_color 
+			&& m_processing_image->id2tex.find(slice.texture_id) == m_processing_image->id2tex.end())
 		{
 			m_processing_image->id2tex[slice.texture_id] = m_images->id2tex[slice.texture_id];
+			m_processing_image->id2format[slice.texture_id] = m_images->id2format[slice.texture_id];
 		}
 
 		m_processing_image->slices.push_back(slice);
@@ -152,6 +176,7 @@ void CCMeshXMLParser::startElement(void *ctx, const char *name, const char **att
 		std::string filename = props["file"];
 		int id = _propertiesInt(props, "id");
 		m_images->id2tex[id] = filename;
+		m_images->id2format[id] = _propertiesExist(props, "format") ? props["format"] : "RGBA8888";
 	}
 	else if (strcmp(name, "textures") == 0)
 	{
@@ -28,6 +28,7 @@ THE SOFTWARE.
 
 #include "platform/CCSAXParser.h"
 #include "support/CCPointExtension.h"
+#include "ccTypes.h"
 
 #include <vector>
 #include <map>
@@ -35,17 +36,25 @@ THE SOFTWARE.
 
 NS_CC_BEGIN
 
+class CCTexture2D;
+
 typedef std::map<int, std::string> iCropperID2TexMap;
+typedef std::map<int, std::string> iCropperID2FormatMap;	// pixel format of pages: RGBA8888, RGB888, RGB565
 
 struct CC_DLL CCMeshSliceInfo
 {
-	CCMeshSliceInfo() : texture_id(0), rotated(false) {}
+	CCMeshSliceInfo() : texture_id(0), rotated(false), flip_x(false), flip_y(false), has_color(false), opaque(false) {}
 
 	int texture_id;
 	CCPoint texture_pos;
 	CCPoint image_pos;
 	CCSize size;
 	bool rotated;
+	bool flip_x;	// mirrored after unrotating, slices shared by duplicated rects
+	bool flip_y;
+	bool has_color;	// a color quad without texture
+	ccColor4B color;
+	bool opaque;	// all pixels alpha 255, drawn without blending
 };
 
 struct CC_DLL CCMeshImageInfo
@@ -56,6 +65,7 @@ struct CC_DLL CCMeshImageInfo
 	CCSize size;
 	float scale_ratio;
 	iCropperID2TexMap id2tex;
+	iCropperID2FormatMap id2format;
 	std::vector<CCMeshSliceInfo> slices;
 };
 
@@ -64,7 +74,11 @@ struct CC_DLL CCMeshFileInfo
 	~CCMeshFileInfo();
 	CCMeshImageInfo* getImage(const char* image_name);
 
+	// load a page to the texture cache in its pixel format
+	static CCTexture2D* addTexture(const char* filename, const std::string& format);
+
 	iCropperID2TexMap id2tex;
+	iCropperID2FormatMap id2format;
 	std::map<std::string, CCMeshImageInfo*> images;
 };
 
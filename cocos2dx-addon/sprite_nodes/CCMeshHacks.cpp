@@ -47,7 +47,7 @@ bool CCSpriteFrameCacheHacker::checkNLoadMeshFile(const std::string& fileName)
 	for (iCropperID2TexMap::iterator it = images->id2tex.begin();
 		it != images->id2tex.end(); it++)
 	{
-		if (!CCTextureCache::sharedTextureCache()->addImage(it->second.c_str()))
+		if (!CCMeshFileInfo::addTexture(it->second.c_str(), images->id2format[it->first]))
 			CCLog("CCMeshFileInfo Load Texture Error: %s", it->second.c_str());
 	}
 
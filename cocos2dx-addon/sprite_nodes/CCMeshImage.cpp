@@ -29,11 +29,16 @@ THE SOFTWARE.
 #include "textures/CCTextureCache.h"
 #include "support/CCPointExtension.h"
 #include "shaders/CCShaderCache.h"
+#include <algorithm>
+
+// color quads a draw, the vertices of one reachable by short indices
+#define CC_MESH_COLOR_QUADS_PER_DRAW	16383
 
 NS_CC_BEGIN
 
 CCMeshImage::CCMeshImage()
 	: m_name(NULL)
+	, m_opaque_color_num(0)
 {
 
 }
@@ -47,6 +52,12 @@ CCMeshImage::~CCMeshImage()
 		CC_SAFE_RELEASE(it->second);
 	}
 	m_atlas_map.clear();
+	for (CCTextureAtlasMap::iterator it = m_opaque_atlas_map.begin();
+		it != m_opaque_atlas_map.end(); it++)
+	{
+		CC_SAFE_RELEASE(it->second);
+	}
+	m_opaque_atlas_map.clear();
 }
 
 CCMeshImage* CCMeshImage::create(CCMeshImageInfo* info)
@@ -63,19 +74,64 @@ CCMeshImage* CCMeshImage::create(CCMeshImageInfo* info)
 	return pRet;
 }
 
+// quad corners of a slice in image space
+static void set_quad_vertices(ccV3F_C4B_T2F_Quad& quad, CCMeshImageInfo* info, const CCMeshSliceInfo& slice)
+{
+	float ele_pos_left = slice.image_pos.x / info->scale_ratio;
+	float ele_pos_top = (slice.image_pos.y + slice.size.height) / info->scale_ratio;
+	float ele_width = slice.size.width / info->scale_ratio;
+	float ele_height = slice.size.height / info->scale_ratio;
+
+	quad.bl.vertices.x = (float) (ele_pos_left);
+	quad.bl.vertices.y = ele_pos_top - ele_height;
+	quad.bl.vertices.z = 0.0f;
+	quad.br.vertices.x = (float)(ele_pos_left + ele_width);
+	quad.br.vertices.y = ele_pos_top - ele_height;
+	quad.br.vertices.z = 0.0f;
+	quad.tl.vertices.x = (float)(ele_pos_left);
+	quad.tl.vertices.y = ele_pos_top;
+	quad.tl.vertices.z = 0.0f;
+	quad.tr.vertices.x = (float)(ele_pos_left + ele_width);
+	quad.tr.vertices.y = ele_pos_top;
+	quad.tr.vertices.z = 0.0f;
+}
+
 bool CCMeshImage::initWithImageInfo(CCMeshImageInfo* info)
 {
 	bool error_found = false;
+	std::vector<ccV3F_C4B_T2F_Quad> translucent_color_quads;
 
 	for (std::vector<CCMeshSliceInfo>::iterator slice = info->slices.begin(); 
 		slice != info->slices.end(); slice++)
 	{
+		ccV3F_C4B_T2F_Quad quad;
+		set_quad_vertices(quad, info, *slice);
+
+		// single colored, no texture
+		if (slice->has_color)
+		{
+			ccColor4B color = slice->color;
+#if CC_OPTIMIZE_BLEND_FUNC_FOR_PREMULTIPLIED_ALPHA
+			// blended as the premultiplied textures are, so premultiply as they are on load
+			color.r = (GLubyte)(color.r * color.a / 255);
+			color.g = (GLubyte)(color.g * color.a / 255);
+			color.b = (GLubyte)(color.b * color.a / 255);
+#endif
+			quad.bl.colors = quad.br.colors = quad.tl.colors = quad.tr.colors = color;
+			if (slice->opaque)
+				m_color_quads.push_back(quad);
+			else
+				translucent_color_quads.push_back(quad);
+			continue;
+		}
+
+		CCTextureAtlasMap& atlas_map = slice->opaque ? m_opaque_atlas_map : m_atlas_map;
 		CCTextureAtlas* atlas = NULL;
-		CCTextureAtlasMap::iterator atlas_it = m_atlas_map.find(slice->texture_id);
-		if (atlas_it == m_atlas_map.end())
+		CCTextureAtlasMap::iterator atlas_it = atlas_map.find(slice->texture_id);
+		if (atlas_it == atlas_map.end())
 		{
 			std::string tex_filename = info->id2tex[slice->texture_id];
-			CCTexture2D* texture = CCTextureCache::sharedTextureCache()->addImage(tex_filename.c_str());
+			CCTexture2D* texture = CCMeshFileInfo::addTexture(tex_filename.c_str(), info->id2format[slice->texture_id]);
 			if (!texture)
 			{
 				error_found = true;
@@ -84,7 +140,7 @@ bool CCMeshImage::initWithImageInfo(CCMeshImageInfo* info)
 			texture->setAliasTexParameters();
 			atlas = new CCTextureAtlas();
 			atlas->initWithTexture(texture, 15);
-			m_atlas_map[slice->texture_id] = atlas;
+			atlas_map[slice->texture_id] = atlas;
 		}
 		else
 		{
@@ -98,17 +154,12 @@ bool CCMeshImage::initWithImageInfo(CCMeshImageInfo* info)
 
 		CCSize tex_size = atlas->getTexture()->getContentSize();
 
+		// rotated slices are turned on the texture, size is in image
+		CCSize tex_slice_size = slice->rotated ? CCSize(slice->size.height, slice->size.width) : slice->size;
 		float left   = slice->texture_pos.x / tex_size.width;
-		float right  = left + slice->size.width / tex_size.width;
+		float right  = left + tex_slice_size.width / tex_size.width;
 		float top    = slice->texture_pos.y / tex_size.height;
-		float bottom = top + slice->size.height / tex_size.height;
-
-		float ele_pos_left = slice->image_pos.x / info->scale_ratio;
-		float ele_pos_top = (slice->image_pos.y + slice->size.height) / info->scale_ratio;
-		float ele_width = slice->size.width / info->scale_ratio;
-		float ele_height = slice->size.height / info->scale_ratio;
-
-		ccV3F_C4B_T2F_Quad quad;
+		float bottom = top + tex_slice_size.height / tex_size.height;
 
 		if (slice->rotated)
 		{
@@ -133,22 +184,35 @@ bool CCMeshImage::initWithImageInfo(CCMeshImageInfo* info)
 			quad.tr.texCoords.v = top;
 		}
 
-		quad.bl.vertices.x = (float) (ele_pos_left);
-		quad.bl.vertices.y = ele_pos_top - ele_height;
-		quad.bl.vertices.z = 0.0f;
-		quad.br.vertices.x = (float)(ele_pos_left + ele_width);
-		quad.br.vertices.y = ele_pos_top - ele_height;
-		quad.br.vertices.z = 0.0f;
-		quad.tl.vertices.x = (float)(ele_pos_left);
-		quad.tl.vertices.y = ele_pos_top;
-		quad.tl.vertices.z = 0.0f;
-		quad.tr.vertices.x = (float)(ele_pos_left + ele_width);
-		quad.tr.vertices.y = ele_pos_top;
-		quad.tr.vertices.z = 0.0f;
+		// mirrored duplicates: swap the uvs of opposite corners
+		if (slice->flip_x)
+		{
+			std::swap(quad.bl.texCoords, quad.br.texCoords);
+			std::swap(quad.tl.texCoords, quad.tr.texCoords);
+		}
+		if (slice->flip_y)
+		{
+			std::swap(quad.bl.texCoords, quad.tl.texCoords);
+			std::swap(quad.br.texCoords, quad.tr.texCoords);
+		}
 
 		atlas->updateQuad(&quad, atlas->getTotalQuads());
 	}
 
+	m_opaque_color_num = (int)m_color_quads.size();
+	m_color_quads.insert(m_color_quads.end(), translucent_color_quads.begin(), translucent_color_quads.end());
+
+	// 2 triangles a color quad, vertices in tl, bl, tr, br order as CCTextureAtlas;
+	// indices of one draw, relative to its first quad
+	int index_quads = (int)m_color_quads.size() < CC_MESH_COLOR_QUADS_PER_DRAW 
+		? (int)m_color_quads.size() : CC_MESH_COLOR_QUADS_PER_DRAW;
+	for (int i = 0; i < index_quads; i++)
+	{
+		GLushort first = (GLushort)(i * 4);
+		GLushort indices[6] = { first, (GLushort)(first + 1), (GLushort)(first + 2), (GLushort)(first + 3), (GLushort)(first + 2), (GLushort)(first + 1) };
+		m_color_indices.insert(m_color_indices.end(), indices, indices + 6);
+	}
+
 	if (!error_found)
 	{
 		m_name = new CCString(info->name);
@@ -166,7 +230,15 @@ bool CCMeshImage::initWithImageInfo(CCMeshImageInfo* info)
 void CCMeshImage::draw()
 {
 	CC_NODE_DRAW_SETUP();
-	
+
+	// opaque slices first, blending off saves fill rate
+	ccGLBlendFunc( GL_ONE, GL_ZERO );
+	for (CCTextureAtlasMap::iterator it = m_opaque_atlas_map.begin();
+		it != m_opaque_atlas_map.end(); it++)
+	{
+		it->second->drawQuads();
+	}
+
 	ccGLBlendFunc( CC_BLEND_SRC, CC_BLEND_DST );
 
 	//GLfloat colors[4] = {_displayedColor.r / 255.0f, _displayedColor.g / 255.0f, _displayedColor.b / 255.0f, _displayedOpacity / 255.0f};
@@ -177,6 +249,41 @@ void CCMeshImage::draw()
 	{
 		it->second->drawQuads();
 	}
+
+	// color quads with vertex colors, opaque ones alike
+	if (!m_color_quads.empty())
+	{
+		CCGLProgram* program = CCShaderCache::sharedShaderCache()->programForKey(kCCShader_PositionColor);
+		program->use();
+		program->setUniformsForBuiltins();
+
+		ccGLBlendFunc( GL_ONE, GL_ZERO );
+		_drawColorQuads(0, m_opaque_color_num);
+		ccGLBlendFunc( CC_BLEND_SRC, CC_BLEND_DST );
+		_drawColorQuads(m_opaque_color_num, (int)m_color_quads.size() - m_opaque_color_num);
+	}
+}
+
+void CCMeshImage::_drawColorQuads(int first, int num)
+{
+	if (num <= 0)
+		return;
+
+	ccGLEnableVertexAttribs(kCCVertexAttribFlag_Position | kCCVertexAttribFlag_Color);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	// short indices reach a limited number of quads, so draw in chunks, indices relative to the chunk
+	const GLsizei stride = sizeof(ccV3F_C4B_T2F);
+	for (int chunk = first; chunk < first + num; chunk += CC_MESH_COLOR_QUADS_PER_DRAW)
+	{
+		int chunk_num = first + num - chunk < CC_MESH_COLOR_QUADS_PER_DRAW ? first + num - chunk : CC_MESH_COLOR_QUADS_PER_DRAW;
+		glVertexAttribPointer(kCCVertexAttrib_Position, 3, GL_FLOAT, GL_FALSE, stride, &m_color_quads[chunk].tl.vertices);
+		glVertexAttribPointer(kCCVertexAttrib_Color, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, &m_color_quads[chunk].tl.colors);
+		glDrawElements(GL_TRIANGLES, (GLsizei)chunk_num * 6, GL_UNSIGNED_SHORT, &m_color_indices[0]);
+
+		CC_INCREMENT_GL_DRAWS(1);
+	}
 }
 
 NS_CC_END
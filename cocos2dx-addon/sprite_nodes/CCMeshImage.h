@@ -29,6 +29,8 @@ THE SOFTWARE.
 #include "base_nodes/CCNode.h"
 #include "textures/CCTextureAtlas.h"
 
+#include <vector>
+
 NS_CC_BEGIN
 
 struct CCMeshImageInfo;
@@ -51,8 +53,14 @@ public:
 	virtual void draw();
 
 private:
+	void _drawColorQuads(int first, int num);
+
 	CCString* m_name;
 	CCTextureAtlasMap m_atlas_map;
+	CCTextureAtlasMap m_opaque_atlas_map;			// opaque slices, drawn first without blending
+	std::vector<ccV3F_C4B_T2F_Quad> m_color_quads;	// single colored slices, drawn without texture; opaque ones first
+	std::vector<GLushort> m_color_indices;
+	int m_opaque_color_num;
 };
 
 NS_CC_END
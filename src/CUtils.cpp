@@ -62,7 +62,7 @@ double CUtils::gettime_seconds()
 	timeval_t tv;
 	if ( CUtils::gettimeofday(&tv, NULL) )
 	{
-		return tv.tv_sec + tv.tv_usec / 1000000.0f;
+		return tv.tv_sec + tv.tv_usec / 1000000.0;
 	}
 
 	return .0f;
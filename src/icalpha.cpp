@@ -0,0 +1,545 @@
+#include "icalpha.h"
+#include <cassert>
+#include <vector>
+#include "CUtils.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#	define ICROPPER_ALPHA_X86	1
+#	include <emmintrin.h>
+#	include <immintrin.h>
+#	if defined(_MSC_VER)
+#		include <intrin.h>
+#		define ICROPPER_TARGET_AVX2
+#	else
+#		define ICROPPER_TARGET_AVX2 __attribute__((target("avx2")))
+#	endif
+#else
+#	define ICROPPER_ALPHA_X86	0
+#endif
+
+namespace icropper {
+
+//////////////////////////////////////////////////////////////////////////
+
+//
+// Scalar Kernels
+//
+// a pixel is used if alpha > threshold, opacity if alpha == 255
+//
+template<int BPP> struct AlphaOf;
+template<> struct AlphaOf<8>	{ static inline BYTE get(const BYTE* bits) { return bits[0]; } };
+template<> struct AlphaOf<32>	{ static inline BYTE get(const BYTE* bits) { return bits[FI_RGBA_ALPHA]; } };
+
+template<int BPP>
+struct ScalarKernel
+{
+	enum { bytespp = BPP / 8 };
+
+	static void count(const BYTE* bits, int width, BYTE threshold, unsigned int& used, unsigned int& opacity)
+	{
+		used = 0;
+		opacity = 0;
+		for (int x = 0; x < width; x++, bits += bytespp)
+		{
+			BYTE alpha = AlphaOf<BPP>::get(bits);
+			used += alpha > threshold;
+			opacity += alpha == 255;
+		}
+	}
+
+	static void pack(const BYTE* bits, int width, BYTE threshold, AlphaWord* used, AlphaWord* opacity)
+	{
+		for (int x = 0; x < width; x += 64)
+		{
+			int num = width - x < 64 ? width - x : 64;
+			AlphaWord used_word = 0, opacity_word = 0;
+			for (int i = 0; i < num; i++, bits += bytespp)
+			{
+				BYTE alpha = AlphaOf<BPP>::get(bits);
+				used_word |= (AlphaWord)(alpha > threshold) << i;
+				opacity_word |= (AlphaWord)(alpha == 255) << i;
+			}
+			*used++ = used_word;
+			*opacity++ = opacity_word;
+		}
+	}
+};
+
+// no alpha channel, every pixel is opacity
+template<>
+struct ScalarKernel<24>
+{
+	static void count(const BYTE*, int width, BYTE, unsigned int& used, unsigned int& opacity)
+	{
+		used = width;
+		opacity = width;
+	}
+
+	static void pack(const BYTE*, int width, BYTE, AlphaWord* used, AlphaWord* opacity)
+	{
+		for (int x = 0; x < width; x += 64)
+		{
+			AlphaWord word = bits_between(0, width - x < 64 ? width - x : 64);
+			*used++ = word;
+			*opacity++ = word;
+		}
+	}
+};
+
+#if ICROPPER_ALPHA_X86
+
+inline unsigned int hsum_epi32(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned int)_mm_cvtsi128_si32(v);
+}
+
+inline unsigned int hsum_epi64(__m128i v)
+{
+	return (unsigned int)(_mm_cvtsi128_si32(v) + _mm_cvtsi128_si32(_mm_srli_si128(v, 8)));
+}
+
+//
+// SSE2 Kernels
+//
+// no unsigned byte compare in SSE2: alpha > threshold iff saturated alpha - threshold != 0
+//
+struct SSE2Kernel32
+{
+	// alpha is the highest byte of a little-endian pixel
+	static void count(const BYTE* bits, int width, BYTE threshold, unsigned int& used, unsigned int& opacity)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i full = _mm_set1_epi32(255);
+		const __m128i limit = _mm_set1_epi32(threshold);
+		__m128i used_acc = zero;
+		__m128i opacity_acc = zero;
+
+		int x = 0;
+		for (; x + 4 <= width; x += 4, bits += 16)
+		{
+			__m128i alpha = _mm_srli_epi32(_mm_loadu_si128((const __m128i*)bits), 24);
+			used_acc = _mm_sub_epi32(used_acc, _mm_cmpgt_epi32(alpha, limit));
+			opacity_acc = _mm_sub_epi32(opacity_acc, _mm_cmpeq_epi32(alpha, full));
+		}
+
+		unsigned int tail_used, tail_opacity;
+		ScalarKernel<32>::count(bits, width - x, threshold, tail_used, tail_opacity);
+		used = hsum_epi32(used_acc) + tail_used;
+		opacity = hsum_epi32(opacity_acc) + tail_opacity;
+	}
+
+	static inline __m128i limit_of(BYTE threshold)
+	{
+		return _mm_set1_epi32((int)((unsigned int)threshold << 24));
+	}
+
+	static void pack(const BYTE* bits, int width, BYTE threshold, AlphaWord* used, AlphaWord* opacity)
+	{
+		const __m128i alpha_mask = _mm_set1_epi32((int)0xFF000000);
+		__m128i limit = limit_of(threshold);
+		int x = 0;
+		for (; x + 64 <= width; x += 64)
+		{
+			AlphaWord used_word = 0, opacity_word = 0;
+			for (int i = 0; i < 64; i += 4, bits += 16)
+			{
+				__m128i alpha = _mm_and_si128(_mm_loadu_si128((const __m128i*)bits), alpha_mask);
+				__m128i over = _mm_subs_epu8(alpha, limit);
+				AlphaWord transparent = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(over, _mm_setzero_si128())));
+				AlphaWord full = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(alpha, alpha_mask)));
+				used_word |= (transparent ^ 0xF) << i;
+				opacity_word |= full << i;
+			}
+			*used++ = used_word;
+			*opacity++ = opacity_word;
+		}
+		ScalarKernel<32>::pack(bits, width - x, threshold, used, opacity);
+	}
+};
+
+struct SSE2Kernel8
+{
+	static void count(const BYTE* bits, int width, BYTE threshold, unsigned int& used, unsigned int& opacity)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi8(1);
+		const __m128i full = _mm_set1_epi8((char)0xFF);
+		const __m128i limit = _mm_set1_epi8((char)threshold);
+		__m128i used_acc = zero;
+		__m128i opacity_acc = zero;
+
+		int x = 0;
+		for (; x + 16 <= width; x += 16, bits += 16)
+		{
+			__m128i alpha = _mm_loadu_si128((const __m128i*)bits);
+			__m128i is_used = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_subs_epu8(alpha, limit), zero), one);
+			__m128i is_opacity = _mm_and_si128(_mm_cmpeq_epi8(alpha, full), one);
+			used_acc = _mm_add_epi64(used_acc, _mm_sad_epu8(is_used, zero));
+			opacity_acc = _mm_add_epi64(opacity_acc, _mm_sad_epu8(is_opacity, zero));
+		}
+
+		unsigned int tail_used, tail_opacity;
+		ScalarKernel<8>::count(bits, width - x, threshold, tail_used, tail_opacity);
+		used = hsum_epi64(used_acc) + tail_used;
+		opacity = hsum_epi64(opacity_acc) + tail_opacity;
+	}
+
+	static void pack(const BYTE* bits, int width, BYTE threshold, AlphaWord* used, AlphaWord* opacity)
+	{
+		const __m128i full = _mm_set1_epi8((char)0xFF);
+		const __m128i limit = _mm_set1_epi8((char)threshold);
+		int x = 0;
+		for (; x + 64 <= width; x += 64)
+		{
+			AlphaWord used_word = 0, opacity_word = 0;
+			for (int i = 0; i < 64; i += 16, bits += 16)
+			{
+				__m128i alpha = _mm_loadu_si128((const __m128i*)bits);
+				AlphaWord transparent = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(alpha, limit), _mm_setzero_si128()));
+				AlphaWord opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(alpha, full));
+				used_word |= (transparent ^ 0xFFFF) << i;
+				opacity_word |= opaque << i;
+			}
+			*used++ = used_word;
+			*opacity++ = opacity_word;
+		}
+		ScalarKernel<8>::pack(bits, width - x, threshold, used, opacity);
+	}
+};
+
+//
+// AVX2 Kernels
+//
+struct AVX2Kernel32
+{
+	ICROPPER_TARGET_AVX2 static void count(const BYTE* bits, int width, BYTE threshold, unsigned int& used, unsigned int& opacity)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i full = _mm256_set1_epi32(255);
+		const __m256i limit = _mm256_set1_epi32(threshold);
+		__m256i used_acc = zero;
+		__m256i opacity_acc = zero;
+
+		int x = 0;
+		for (; x + 8 <= width; x += 8, bits += 32)
+		{
+			__m256i alpha = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i*)bits), 24);
+			used_acc = _mm256_sub_epi32(used_acc, _mm256_cmpgt_epi32(alpha, limit));
+			opacity_acc = _mm256_sub_epi32(opacity_acc, _mm256_cmpeq_epi32(alpha, full));
+		}
+
+		unsigned int tail_used, tail_opacity;
+		SSE2Kernel32::count(bits, width - x, threshold, tail_used, tail_opacity);
+		used = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(used_acc), _mm256_extracti128_si256(used_acc, 1))) + tail_used;
+		opacity = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(opacity_acc), _mm256_extracti128_si256(opacity_acc, 1))) + tail_opacity;
+	}
+
+	ICROPPER_TARGET_AVX2 static void pack(const BYTE* bits, int width, BYTE threshold, AlphaWord* used, AlphaWord* opacity)
+	{
+		const __m256i alpha_mask = _mm256_set1_epi32((int)0xFF000000);
+		const __m256i limit = _mm256_set1_epi32((int)((unsigned int)threshold << 24));
+		int x = 0;
+		for (; x + 64 <= width; x += 64)
+		{
+			AlphaWord used_word = 0, opacity_word = 0;
+			for (int i = 0; i < 64; i += 8, bits += 32)
+			{
+				__m256i alpha = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)bits), alpha_mask);
+				__m256i over = _mm256_subs_epu8(alpha, limit);
+				AlphaWord transparent = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(over, _mm256_setzero_si256())));
+				AlphaWord full = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(alpha, alpha_mask)));
+				used_word |= (transparent ^ 0xFF) << i;
+				opacity_word |= full << i;
+			}
+			*used++ = used_word;
+			*opacity++ = opacity_word;
+		}
+		ScalarKernel<32>::pack(bits, width - x, threshold, used, opacity);
+	}
+};
+
+struct AVX2Kernel8
+{
+	ICROPPER_TARGET_AVX2 static void count(const BYTE* bits, int width, BYTE threshold, unsigned int& used, unsigned int& opacity)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i one = _mm256_set1_epi8(1);
+		const __m256i full = _mm256_set1_epi8((char)0xFF);
+		const __m256i limit = _mm256_set1_epi8((char)threshold);
+		__m256i used_acc = zero;
+		__m256i opacity_acc = zero;
+
+		int x = 0;
+		for (; x + 32 <= width; x += 32, bits += 32)
+		{
+			__m256i alpha = _mm256_loadu_si256((const __m256i*)bits);
+			__m256i is_used = _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_subs_epu8(alpha, limit), zero), one);
+			__m256i is_opacity = _mm256_and_si256(_mm256_cmpeq_epi8(alpha, full), one);
+			used_acc = _mm256_add_epi64(used_acc, _mm256_sad_epu8(is_used, zero));
+			opacity_acc = _mm256_add_epi64(opacity_acc, _mm256_sad_epu8(is_opacity, zero));
+		}
+
+		unsigned int tail_used, tail_opacity;
+		SSE2Kernel8::count(bits, width - x, threshold, tail_used, tail_opacity);
+		used = hsum_epi64(_mm_add_epi64(_mm256_castsi256_si128(used_acc), _mm256_extracti128_si256(used_acc, 1))) + tail_used;
+		opacity = hsum_epi64(_mm_add_epi64(_mm256_castsi256_si128(opacity_acc), _mm256_extracti128_si256(opacity_acc, 1))) + tail_opacity;
+	}
+
+	ICROPPER_TARGET_AVX2 static void pack(const BYTE* bits, int width, BYTE threshold, AlphaWord* used, AlphaWord* opacity)
+	{
+		const __m256i full = _mm256_set1_epi8((char)0xFF);
+		const __m256i limit = _mm256_set1_epi8((char)threshold);
+		int x = 0;
+		for (; x + 64 <= width; x += 64)
+		{
+			AlphaWord used_word = 0, opacity_word = 0;
+			for (int i = 0; i < 64; i += 32, bits += 32)
+			{
+				__m256i alpha = _mm256_loadu_si256((const __m256i*)bits);
+				AlphaWord transparent = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(alpha, limit), _mm256_setzero_si256()));
+				AlphaWord opaque = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(alpha, full));
+				used_word |= (transparent ^ 0xFFFFFFFFULL) << i;
+				opacity_word |= opaque << i;
+			}
+			*used++ = used_word;
+			*opacity++ = opacity_word;
+		}
+		ScalarKernel<8>::pack(bits, width - x, threshold, used, opacity);
+	}
+};
+
+#endif // ICROPPER_ALPHA_X86
+
+//////////////////////////////////////////////////////////////////////////
+
+#define ICROPPER_ALPHA_KERNEL(name, K) { name, &K::count, &K::pack }
+
+// [isa][layout], layouts are 8, 24, 32 bits
+static const AlphaKernel s_alpha_kernels[kAlphaISANum][3] =
+{
+	{
+		ICROPPER_ALPHA_KERNEL("scalar-8", ScalarKernel<8>),
+		ICROPPER_ALPHA_KERNEL("scalar-24", ScalarKernel<24>),
+		ICROPPER_ALPHA_KERNEL("scalar-32", ScalarKernel<32>),
+	},
+#if ICROPPER_ALPHA_X86
+	{
+		ICROPPER_ALPHA_KERNEL("sse2-8", SSE2Kernel8),
+		ICROPPER_ALPHA_KERNEL("sse2-24", ScalarKernel<24>),
+		ICROPPER_ALPHA_KERNEL("sse2-32", SSE2Kernel32),
+	},
+	{
+		ICROPPER_ALPHA_KERNEL("avx2-8", AVX2Kernel8),
+		ICROPPER_ALPHA_KERNEL("avx2-24", ScalarKernel<24>),
+		ICROPPER_ALPHA_KERNEL("avx2-32", AVX2Kernel32),
+	},
+#else
+	{
+		ICROPPER_ALPHA_KERNEL("scalar-8", ScalarKernel<8>),
+		ICROPPER_ALPHA_KERNEL("scalar-24", ScalarKernel<24>),
+		ICROPPER_ALPHA_KERNEL("scalar-32", ScalarKernel<32>),
+	},
+	{
+		ICROPPER_ALPHA_KERNEL("scalar-8", ScalarKernel<8>),
+		ICROPPER_ALPHA_KERNEL("scalar-24", ScalarKernel<24>),
+		ICROPPER_ALPHA_KERNEL("scalar-32", ScalarKernel<32>),
+	},
+#endif
+};
+
+#undef ICROPPER_ALPHA_KERNEL
+
+static AlphaKernelISA detect_alpha_isa()
+{
+#if ICROPPER_ALPHA_X86
+#	if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool avx2 = false;
+	// os must save ymm registers
+	if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+#	else
+	__builtin_cpu_init();
+	bool sse2 = __builtin_cpu_supports("sse2") != 0;
+	bool avx2 = __builtin_cpu_supports("avx2") != 0;
+#	endif
+	if (avx2)
+		return kAlphaAVX2;
+	if (sse2)
+		return kAlphaSSE2;
+#endif
+	return kAlphaScalar;
+}
+
+// picked once at startup
+static const AlphaKernelISA s_supported_isa = detect_alpha_isa();
+static AlphaKernelISA s_selected_isa = s_supported_isa;
+
+const AlphaKernel* get_alpha_kernel(int bitspp, AlphaKernelISA isa)
+{
+	if (!is_alpha_isa_supported(isa))
+		return NULL;
+
+	switch (bitspp)
+	{
+	case 8:		return &s_alpha_kernels[isa][0];
+	case 24:	return &s_alpha_kernels[isa][1];
+	case 32:	return &s_alpha_kernels[isa][2];
+	default:	return NULL;
+	}
+}
+
+const AlphaKernel* get_alpha_kernel(int bitspp)
+{
+	return get_alpha_kernel(bitspp, s_selected_isa);
+}
+
+bool is_alpha_isa_supported(AlphaKernelISA isa)
+{
+	return isa >= kAlphaScalar && isa <= s_supported_isa;
+}
+
+AlphaKernelISA get_alpha_isa()
+{
+	return s_selected_isa;
+}
+
+void set_alpha_isa(AlphaKernelISA isa)
+{
+	assert(is_alpha_isa_supported(isa) && "Error: ISA Not Supported!");
+	s_selected_isa = is_alpha_isa_supported(isa) ? isa : kAlphaScalar;
+}
+
+const char* get_alpha_isa_name(AlphaKernelISA isa)
+{
+	switch (isa)
+	{
+	case kAlphaScalar:	return "scalar";
+	case kAlphaSSE2:	return "sse2";
+	case kAlphaAVX2:	return "avx2";
+	default:			return "unknown";
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+int bench_alpha_kernels(int width /*= 2048*/, int height /*= 2048*/, BYTE threshold /*= 0*/)
+{
+	const int layouts[] = { 8, 24, 32 };
+	const double min_seconds = 0.2;
+	int retv = 0;
+
+	AlphaKernelISA selected_isa = get_alpha_isa();
+	printf("alpha kernels: %dx%d, alpha threshold: %d, startup isa: %s\n", width, height, threshold, get_alpha_isa_name(selected_isa));
+
+	for (int li = 0; li < 3; li++)
+	{
+		int bytespp = layouts[li] / 8;
+		int pitch = (width * bytespp + 3) & ~3;
+		std::vector<BYTE> pixels(pitch * height, 0);
+
+		// a centered blob with soft edges, transparent borders
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				int dx = x - width / 2, dy = y - height / 2;
+				int d2 = dx * dx + dy * dy, r = height / 3;
+				BYTE alpha = d2 < r * r ? 255 : (d2 < (r + 8) * (r + 8) ? (BYTE)((x * 7 + y * 13) & 0xFF) : 0);
+				BYTE* bits = &pixels[y * pitch + x * bytespp];
+				for (int c = 0; c < bytespp; c++)
+					bits[c] = (BYTE)(x + y);
+				if (bytespp == 1)
+					bits[0] = alpha;
+				else if (bytespp == 4)
+					bits[FI_RGBA_ALPHA] = alpha;
+			}
+		}
+
+		PixelView view;
+		view.bits = &pixels[0];
+		view.pitch = pitch;
+		view.bytespp = bytespp;
+		view.size = Size(width, height);
+
+		unsigned int ref_used = 0, ref_opacity = 0;
+		int plane_pitch = (width + 63) / 64;
+		std::vector<AlphaWord> used_plane(plane_pitch * height), opacity_plane(plane_pitch * height);
+		std::vector<AlphaWord> ref_used_plane, ref_opacity_plane;
+		for (int isa = kAlphaScalar; isa < kAlphaISANum; isa++)
+		{
+			if (!is_alpha_isa_supported((AlphaKernelISA)isa))
+				continue;
+			set_alpha_isa((AlphaKernelISA)isa);
+			const AlphaKernel* kernel = get_alpha_kernel(layouts[li]);
+
+			// count
+			unsigned int used = 0, opacity = 0;
+			int rounds = 0;
+			double begin = CUtils::gettime_seconds(), elapsed = 0;
+			do
+			{
+				used = 0;
+				opacity = 0;
+				for (int y = 0; y < height; y++)
+				{
+					unsigned int line_used, line_opacity;
+					kernel->count(view.getLine(y), width, threshold, line_used, line_opacity);
+					used += line_used;
+					opacity += line_opacity;
+				}
+				rounds++;
+				elapsed = CUtils::gettime_seconds() - begin;
+			} while (elapsed < min_seconds);
+			double count_mpps = 1.0 * rounds * width * height / elapsed / 1000000.0;
+
+			// bit planes
+			rounds = 0;
+			begin = CUtils::gettime_seconds();
+			do
+			{
+				for (int y = 0; y < height; y++)
+				{
+					kernel->pack(view.getLine(y), width, threshold, &used_plane[y * plane_pitch], &opacity_plane[y * plane_pitch]);
+				}
+				rounds++;
+				elapsed = CUtils::gettime_seconds() - begin;
+			} while (elapsed < min_seconds);
+			double pack_mpps = 1.0 * rounds * width * height / elapsed / 1000000.0;
+
+			printf("  %-10s count: %9.1f Mpixels/s, pack: %9.1f Mpixels/s\n",
+				kernel->name, count_mpps, pack_mpps);
+
+			// every kernel must agree with scalar
+			if (isa == kAlphaScalar)
+			{
+				ref_used = used;
+				ref_opacity = opacity;
+				ref_used_plane = used_plane;
+				ref_opacity_plane = opacity_plane;
+			}
+			else if (used != ref_used || opacity != ref_opacity
+				|| used_plane != ref_used_plane || opacity_plane != ref_opacity_plane)
+			{
+				printf("  [ERR] %s mismatches scalar kernel!\n", get_alpha_kernel(layouts[li])->name);
+				retv = -1;
+			}
+		}
+	}
+
+	set_alpha_isa(selected_isa);
+	return retv;
+}
+
+} // icropper
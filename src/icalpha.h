@@ -0,0 +1,104 @@
+#ifndef ICALPHA_H_
+#define ICALPHA_H_
+
+#include "icropper.h"
+
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#endif
+
+namespace icropper {
+
+//
+// Alpha Scanning Kernels
+//
+// specialized at compile time for pixel layouts:
+//	8 bits:  alpha only
+//	24 bits: no alpha, all pixels opacity
+//	32 bits: RGBA, alpha at FI_RGBA_ALPHA
+//
+enum AlphaKernelISA
+{
+	kAlphaScalar = 0,
+	kAlphaSSE2,
+	kAlphaAVX2,
+	kAlphaISANum
+};
+
+struct AlphaKernel
+{
+	const char* name;
+
+	// a pixel is used if alpha > threshold
+
+	// count pixels used and alpha == 255 in a line
+	void (*count)(const BYTE* bits, int width, BYTE threshold, unsigned int& used, unsigned int& opacity);
+	// bit planes of a line, (width + 63) / 64 words each: used & alpha == 255
+	void (*pack)(const BYTE* bits, int width, BYTE threshold, AlphaWord* used, AlphaWord* opacity);
+};
+
+//
+// Bit Utils of Alpha Planes
+//
+inline int popcount64(AlphaWord word)
+{
+#if defined(__GNUC__)
+	return __builtin_popcountll(word);
+#else
+	// no POPCNT instruction assumed on 32-bit builds
+	word = word - ((word >> 1) & 0x5555555555555555ULL);
+	word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+	word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+inline int bit_scan_forward64(AlphaWord word)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(word);
+#else
+	unsigned long idx;
+	if (_BitScanForward(&idx, (unsigned long)word))
+		return (int)idx;
+	_BitScanForward(&idx, (unsigned long)(word >> 32));
+	return (int)idx + 32;
+#endif
+}
+
+inline int bit_scan_reverse64(AlphaWord word)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(word);
+#else
+	unsigned long idx;
+	if (_BitScanReverse(&idx, (unsigned long)(word >> 32)))
+		return (int)idx + 32;
+	_BitScanReverse(&idx, (unsigned long)word);
+	return (int)idx;
+#endif
+}
+
+// bits [begin, end) of a word, 0 <= begin < end <= 64
+inline AlphaWord bits_between(int begin, int end)
+{
+	AlphaWord high = end >= 64 ? ~0ULL : ((1ULL << end) - 1);
+	return high & ~((1ULL << begin) - 1);
+}
+
+// kernel for layout & isa, NULL if not available
+const AlphaKernel* get_alpha_kernel(int bitspp, AlphaKernelISA isa);
+// kernel for layout with the isa picked at startup
+const AlphaKernel* get_alpha_kernel(int bitspp);
+
+bool is_alpha_isa_supported(AlphaKernelISA isa);
+AlphaKernelISA get_alpha_isa();
+void set_alpha_isa(AlphaKernelISA isa); // force an isa, for benchmark & debug
+const char* get_alpha_isa_name(AlphaKernelISA isa);
+
+// micro-benchmark: print pixels per second of each kernel
+int bench_alpha_kernels(int width = 2048, int height = 2048, BYTE threshold = 0);
+
+} // icropper
+
+#endif
@@ -0,0 +1,276 @@
+#include "icpack.h"
+#include <cassert>
+#include <limits.h>
+
+namespace icropper {
+
+static inline int zone_right(const Zone& zone) { return zone.pos.x + zone.size.width; }
+static inline int zone_bottom(const Zone& zone) { return zone.pos.y + zone.size.height; }
+
+static inline bool zone_contains(const Zone& outer, const Zone& inner)
+{
+	return inner.pos.x >= outer.pos.x && inner.pos.y >= outer.pos.y
+		&& zone_right(inner) <= zone_right(outer) && zone_bottom(inner) <= zone_bottom(outer);
+}
+
+// length of [begin0, end0) & [begin1, end1) in common
+static inline int common_length(int begin0, int end0, int begin1, int end1)
+{
+	return max(0, min(end0, end1) - max(begin0, begin1));
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+MaxRectsBin::MaxRectsBin(const Zone& bounds, int padding, MaxRectsHeuristic heuristic)
+: PackBin(bounds, padding)
+, m_heuristic(heuristic)
+{
+	m_free_rects.push_back(bounds);
+}
+
+bool MaxRectsBin::insert(Size size, bool allow_rotate, Zone& zone, bool& rotated)
+{
+	Size padded(size.width + m_padding, size.height + m_padding);
+	Size turned(padded.height, padded.width);
+	bool try_turned = allow_rotate && padded.width != padded.height;
+
+	int best_score = INT_MAX, best_tie = INT_MAX;
+	bool found = false, best_turned = false;
+	Zone best;
+	for (auto& free_rect: m_free_rects)
+	{
+		for (int turn = 0; turn < (try_turned ? 2 : 1); turn++)
+		{
+			Size trial = turn ? turned : padded;
+			if (!free_rect.contains(trial))
+				continue;
+
+			int score = 0, tie = 0;
+			_score(free_rect, trial, score, tie);
+			if (score < best_score || (score == best_score && tie < best_tie))
+			{
+				best_score = score;
+				best_tie = tie;
+				best = Zone(free_rect.pos, trial);
+				best_turned = turn != 0;
+				found = true;
+			}
+		}
+	}
+
+	if (!found)
+		return false;
+
+	_place(best);
+	rotated = best_turned;
+	zone = Zone(best.pos, rotated ? Size(size.height, size.width) : size);
+	return true;
+}
+
+void MaxRectsBin::_score(const Zone& free_rect, Size size, int& score, int& tie) const
+{
+	int leftover_width = free_rect.size.width - size.width;
+	int leftover_height = free_rect.size.height - size.height;
+
+	switch (m_heuristic)
+	{
+	case kMaxRectsBestShortSideFit:
+		score = min(leftover_width, leftover_height);
+		tie = max(leftover_width, leftover_height);
+		break;
+	case kMaxRectsBestAreaFit:
+		score = free_rect.size.width * free_rect.size.height - size.width * size.height;
+		tie = min(leftover_width, leftover_height);
+		break;
+	case kMaxRectsBottomLeft:
+		// y is down on textures: the top most, then the left most
+		score = free_rect.pos.y + size.height;
+		tie = free_rect.pos.x;
+		break;
+	case kMaxRectsContactPoint:
+		score = -_contactLength(Zone(free_rect.pos, size));
+		tie = free_rect.pos.y + size.height;
+		break;
+	default:
+		assert(false && "Error: Unknown MaxRects Heuristic!");
+		score = tie = 0;
+		break;
+	}
+}
+
+int MaxRectsBin::_contactLength(const Zone& zone) const
+{
+	int length = 0;
+	if (zone.pos.x == m_bounds.pos.x || zone_right(zone) == zone_right(m_bounds))
+		length += zone.size.height;
+	if (zone.pos.y == m_bounds.pos.y || zone_bottom(zone) == zone_bottom(m_bounds))
+		length += zone.size.width;
+
+	for (auto& used: m_used_rects)
+	{
+		if (used.pos.x == zone_right(zone) || zone_right(used) == zone.pos.x)
+			length += common_length(used.pos.y, zone_bottom(used), zone.pos.y, zone_bottom(zone));
+		if (used.pos.y == zone_bottom(zone) || zone_bottom(used) == zone.pos.y)
+			length += common_length(used.pos.x, zone_right(used), zone.pos.x, zone_right(zone));
+	}
+	return length;
+}
+
+void MaxRectsBin::_place(const Zone& used)
+{
+	// free rects cut by the used one are replaced by their maximal remains
+	std::vector<Zone> new_rects;
+	for (size_t i = 0; i < m_free_rects.size(); )
+	{
+		Zone free_rect = m_free_rects[i];
+		if (used.pos.x >= zone_right(free_rect) || zone_right(used) <= free_rect.pos.x
+			|| used.pos.y >= zone_bottom(free_rect) || zone_bottom(used) <= free_rect.pos.y)
+		{
+			i++;
+			continue;
+		}
+
+		if (used.pos.y > free_rect.pos.y) // above
+			new_rects.push_back(Zone(free_rect.pos, Size(free_rect.size.width, used.pos.y - free_rect.pos.y)));
+		if (zone_bottom(used) < zone_bottom(free_rect)) // below
+			new_rects.push_back(Zone(Position(free_rect.pos.x, zone_bottom(used)),
+				Size(free_rect.size.width, zone_bottom(free_rect) - zone_bottom(used))));
+		if (used.pos.x > free_rect.pos.x) // left
+			new_rects.push_back(Zone(free_rect.pos, Size(used.pos.x - free_rect.pos.x, free_rect.size.height)));
+		if (zone_right(used) < zone_right(free_rect)) // right
+			new_rects.push_back(Zone(Position(zone_right(used), free_rect.pos.y),
+				Size(zone_right(free_rect) - zone_right(used), free_rect.size.height)));
+
+		m_free_rects[i] = m_free_rects.back();
+		m_free_rects.pop_back();
+	}
+
+	_prune(new_rects);
+	if (m_heuristic == kMaxRectsContactPoint)
+		m_used_rects.push_back(used);
+}
+
+void MaxRectsBin::_prune(std::vector<Zone>& new_rects)
+{
+	// no free rect was contained in another before, so only the new ones may be;
+	// of equal new rects the first stays
+	for (size_t i = 0; i < new_rects.size(); i++)
+	{
+		bool contained = false;
+		for (size_t j = 0; j < new_rects.size() && !contained; j++)
+		{
+			contained = j != i && zone_contains(new_rects[j], new_rects[i])
+				&& (j < i || !zone_contains(new_rects[i], new_rects[j]));
+		}
+		for (size_t j = 0; j < m_free_rects.size() && !contained; j++)
+		{
+			contained = zone_contains(m_free_rects[j], new_rects[i]);
+		}
+
+		if (!contained)
+			m_free_rects.push_back(new_rects[i]);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+SkylineBin::SkylineBin(const Zone& bounds, int padding)
+: PackBin(bounds, padding)
+{
+	m_skyline.push_back(Segment(bounds.pos.x, bounds.pos.y, bounds.size.width));
+}
+
+bool SkylineBin::insert(Size size, bool allow_rotate, Zone& zone, bool& rotated)
+{
+	Size padded(size.width + m_padding, size.height + m_padding);
+	Size turned(padded.height, padded.width);
+	bool try_turned = allow_rotate && padded.width != padded.height;
+
+	int best_bottom = INT_MAX, best_width = INT_MAX;
+	bool found = false, best_turned = false;
+	size_t best_idx = 0;
+	Zone best;
+	for (size_t i = 0; i < m_skyline.size(); i++)
+	{
+		for (int turn = 0; turn < (try_turned ? 2 : 1); turn++)
+		{
+			Size trial = turn ? turned : padded;
+			int y = 0;
+			if (!_fit(i, trial, y))
+				continue;
+
+			int bottom = y + trial.height;
+			if (bottom < best_bottom || (bottom == best_bottom && m_skyline[i].width < best_width))
+			{
+				best_bottom = bottom;
+				best_width = m_skyline[i].width;
+				best_idx = i;
+				best = Zone(Position(m_skyline[i].x, y), trial);
+				best_turned = turn != 0;
+				found = true;
+			}
+		}
+	}
+
+	if (!found)
+		return false;
+
+	_place(best_idx, best);
+	rotated = best_turned;
+	zone = Zone(best.pos, rotated ? Size(size.height, size.width) : size);
+	return true;
+}
+
+bool SkylineBin::_fit(size_t idx, Size size, int& y) const
+{
+	if (m_skyline[idx].x + size.width > zone_right(m_bounds))
+		return false;
+
+	y = m_skyline[idx].y;
+	for (int width_left = size.width; width_left > 0; idx++)
+	{
+		y = max(y, m_skyline[idx].y);
+		if (y + size.height > zone_bottom(m_bounds))
+			return false;
+		width_left -= m_skyline[idx].width;
+	}
+	return true;
+}
+
+void SkylineBin::_place(size_t idx, const Zone& used)
+{
+	m_skyline.insert(m_skyline.begin() + idx, Segment(used.pos.x, zone_bottom(used), used.size.width));
+
+	// cut segments under the new one
+	int right = zone_right(used);
+	for (size_t i = idx + 1; i < m_skyline.size(); )
+	{
+		Segment& segment = m_skyline[i];
+		if (segment.x >= right)
+			break;
+
+		int shrink = right - segment.x;
+		if (segment.width <= shrink)
+		{
+			m_skyline.erase(m_skyline.begin() + i);
+			continue;
+		}
+		segment.x += shrink;
+		segment.width -= shrink;
+		break;
+	}
+
+	// merge neighbors of the same top
+	if (idx + 1 < m_skyline.size() && m_skyline[idx].y == m_skyline[idx + 1].y)
+	{
+		m_skyline[idx].width += m_skyline[idx + 1].width;
+		m_skyline.erase(m_skyline.begin() + idx + 1);
+	}
+	if (idx > 0 && m_skyline[idx - 1].y == m_skyline[idx].y)
+	{
+		m_skyline[idx - 1].width += m_skyline[idx].width;
+		m_skyline.erase(m_skyline.begin() + idx);
+	}
+}
+
+} // icropper
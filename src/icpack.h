@@ -0,0 +1,88 @@
+#ifndef ICPACK_H_
+#define ICPACK_H_
+
+#include "icropper.h"
+
+namespace icropper {
+
+//
+// Packing Bin of a Texture Page
+//
+// rects take their size plus the padding on right & bottom, so the bounds
+// start after the left & top padding and run to the page border.
+//
+class PackBin
+{
+public:
+	PackBin(const Zone& bounds, int padding) : m_bounds(bounds), m_padding(padding) {}
+	virtual ~PackBin() {}
+
+	// zone of a rect on the page, false if no room; rotated reps placed turned
+	virtual bool insert(Size size, bool allow_rotate, Zone& zone, bool& rotated) = 0;
+
+	inline const Zone& getBounds() const { return m_bounds; }
+
+protected:
+	Zone m_bounds;
+	int m_padding;
+};
+
+//
+// MaxRects Bin
+//
+// free space is the list of maximal free rects, which may overlap; a placed
+// rect splits every free rect it cuts into, then contained ones are pruned.
+//
+class MaxRectsBin : public PackBin
+{
+public:
+	MaxRectsBin(const Zone& bounds, int padding, MaxRectsHeuristic heuristic);
+
+	virtual bool insert(Size size, bool allow_rotate, Zone& zone, bool& rotated);
+
+private:
+	// lower is better, tie breaks on the second score
+	void _score(const Zone& free_rect, Size size, int& score, int& tie) const;
+	int _contactLength(const Zone& zone) const;
+	void _place(const Zone& used);
+	void _prune(std::vector<Zone>& new_rects);
+
+	MaxRectsHeuristic m_heuristic;
+	std::vector<Zone> m_free_rects;
+	std::vector<Zone> m_used_rects;	// padded, for contact point only
+};
+
+//
+// Skyline Bin
+//
+// free space is the top outline of placed rects, as segments left to right;
+// a rect goes where its bottom is the highest, then on the narrowest segment.
+// holes under the outline are never filled, for speed.
+//
+class SkylineBin : public PackBin
+{
+public:
+	SkylineBin(const Zone& bounds, int padding);
+
+	virtual bool insert(Size size, bool allow_rotate, Zone& zone, bool& rotated);
+
+private:
+	struct Segment
+	{
+		Segment(int _x, int _y, int _width) : x(_x), y(_y), width(_width) {}
+
+		int x;
+		int y;		// top of free space
+		int width;
+	};
+
+	// top of a rect put at the segment, false if out of bounds
+	bool _fit(size_t idx, Size size, int& y) const;
+	void _place(size_t idx, const Zone& used);
+
+	std::vector<Segment> m_skyline;
+};
+
+} // icropper
+
+#endif
@@ -1,36 +1,39 @@
 #include "icropper.h"
 #include <cassert>
 #include <algorithm>
+#include <queue>
+#include <functional>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <new>
+#include <map>
+#include <chrono>
+#include <random>
 #include "tinyxml2.h"
 #include "CUtils.h"
+#include "icalpha.h"
+#include "ictasks.h"
+#include "icpack.h"
 
 namespace icropper {
 
-//////////////////////////////////////////////////////////////////////////
-
-//
-// traversal FreeImage Pixels
-//
-template<typename F>
-void traversal_pixels(fipImage* image, F handler)
-{
-	int bytespp = image->getLine() / image->getWidth();
-
-	for(unsigned int y = 0; y < image->getHeight(); y++) 
-	{
-		BYTE *bits = image->getScanLine(y);
-		for(unsigned int x = 0; x < image->getWidth(); x++) 
-		{
-			// handle pixel
-			// y is reversed
-			handler(bits, x, image->getHeight() - y - 1);
+// minimum lines of a band when building alpha tables in parallel
+#define ICROPPER_ALPHA_BAND_MIN_LINES	64
+// rects per arena chunk
+#define ICROPPER_RECT_ARENA_CHUNK		4096
+// slices per pool chunk of compositor
+#define ICROPPER_SLICE_POOL_CHUNK		4096
+// pack plan annealing, the same seed & attempts give the same textures
+#define ICROPPER_ANNEAL_SEED			20130704
+#define ICROPPER_ANNEAL_START_TEMPERATURE	0.02
+// maximum cells per side of the optimal split grid, states grow as its 4th power
+#define ICROPPER_OPTIMAL_MAX_CELLS		16
+// leaves closer than the gap are neighbors when merging
+#define ICROPPER_MERGE_NEIGHBOR_GAP		8
 
-			// jump to next pixel
-			bits += bytespp;
-		}
-	}
-}
+//////////////////////////////////////////////////////////////////////////
 
 inline unsigned int next_power_of_two(unsigned int x)
 {
@@ -44,16 +47,67 @@ inline unsigned int next_power_of_two(unsigned int x)
 
 //////////////////////////////////////////////////////////////////////////
 
+RectArena::RectArena()
+: m_rect_count(0)
+{
+}
+
+RectArena::~RectArena()
+{
+	clear();
+}
+
+ImageRect* RectArena::alloc(int num)
+{
+	assert(num > 0 && "Error: Invalid Rect Number!");
+	std::lock_guard<std::mutex> guard(m_lock);
+
+	if (m_chunks.empty() || m_chunks.back().capacity - m_chunks.back().used < num)
+	{
+		Chunk chunk;
+		chunk.capacity = max(num, ICROPPER_RECT_ARENA_CHUNK);
+		chunk.used = 0;
+		chunk.rects = static_cast<ImageRect*>(::operator new(chunk.capacity * sizeof(ImageRect)));
+		m_chunks.push_back(chunk);
+	}
+
+	Chunk& chunk = m_chunks.back();
+	ImageRect* rects = chunk.rects + chunk.used;
+	chunk.used += num;
+	m_rect_count += num;
+	return rects;
+}
+
+void RectArena::clear()
+{
+	// every allocated rect is constructed by its owner
+	for (auto& chunk: m_chunks)
+	{
+		for (int i = 0; i < chunk.used; i++)
+		{
+			chunk.rects[i].~ImageRect();
+		}
+		::operator delete(chunk.rects);
+	}
+	m_chunks.clear();
+	m_rect_count = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
 Image::Image()
 : m_raw_image(NULL)
 , m_root_rect(NULL)
+, m_cropped_rect_count(0)
+, m_is_opaque(false)
+, m_plane_pitch(0)
 {
 
 }
 
 Image::~Image()
 {
-	delete m_root_rect;
+	m_arena.clear();
 	delete m_raw_image;
 }
 
@@ -68,17 +122,34 @@ Image* Image::createWithFileName(const char* filename, const char* path /*= NULL
 	fullpath += filename;
 	
 	fipImage* fimage = new fipImage;
-	if (fimage->load(fullpath.c_str()))
+	if (!fimage->load(fullpath.c_str()))
 	{
-		Image* image = new Image;
-		image->m_filename = filename;
-		image->m_raw_image = fimage;
-		image->m_raw_size = Size(fimage->getWidth(), fimage->getHeight());
+		delete fimage;
+		return NULL;
+	}
+
+	// 24 bits without a transparent color has no alpha at all
+	bool is_opaque = fimage->getImageType() == FIT_BITMAP 
+		&& fimage->getBitsPerPixel() == 24 && !fimage->isTransparent();
 
-		return image;
+	// one layout for analysis & pasting: RGBA, converted once here
+	if (fimage->getImageType() != FIT_BITMAP || fimage->getBitsPerPixel() != 32)
+	{
+		if (!fimage->convertTo32Bits())
+		{
+			assert(false && "Error: Unsupported Image Format!");
+			delete fimage;
+			return NULL;
+		}
 	}
-	delete fimage;
-	return NULL;
+
+	Image* image = new Image;
+	image->m_filename = filename;
+	image->m_raw_image = fimage;
+	image->m_raw_size = Size(fimage->getWidth(), fimage->getHeight());
+	image->m_is_opaque = is_opaque || image->_scanOpaque();
+
+	return image;
 }
 
 bool Image::crop()
@@ -97,296 +168,1133 @@ bool Image::crop()
 		m_raw_size = scaled_size;
 	}
 
-	m_root_rect = new ImageRect(new fipImage(*m_raw_image), this, NULL, Position(0, 0));
+	m_root_rect = new (m_arena.alloc(1)) ImageRect(this, NULL, Zone(Position(0, 0), m_raw_size));
 
-	m_root_rect->cropWithFixedSize(getOptions().block_size);
+	if (m_is_opaque)
+	{
+		// nothing to cut away: a single leaf, or a grid of rects fitting in a texture
+		int max_size = getOptions().max_rect_size;
+		assert(max_size > 0 && "Error: Invalid Max Rect Size!");
+		if (m_raw_size.width > max_size || m_raw_size.height > max_size)
+			m_root_rect->cropWithFixedSize(Size(max_size, max_size));
+	}
+	else
+	{
+		_buildAlphaPlanes();
+		m_root_rect->cropWithFixedSize(getOptions().block_size);
+	}
 	m_root_rect->getLeafRects(m_rects);
+	m_cropped_rect_count = (int)m_rects.size();
+
+	if (getOptions().merge_growth > 0.0f)
+		_mergeRects();
 	return true;
 }
 
-//////////////////////////////////////////////////////////////////////////
+void Image::getPixelCount(const Zone& zone, unsigned int& used, unsigned int& opacity)
+{
+	assert(zone.pos.x >= 0 && zone.pos.y >= 0 
+		&& zone.pos.x + zone.size.width <= m_raw_size.width 
+		&& zone.pos.y + zone.size.height <= m_raw_size.height && "Error: Zone Out of Image!");
+
+	used = 0;
+	opacity = 0;
+	if (zone.size.width <= 0 || zone.size.height <= 0)
+		return;
 
+	// no planes for opaque images, every pixel counts
+	if (m_is_opaque)
+	{
+		used = opacity = zone.size.width * zone.size.height;
+		return;
+	}
+	assert(!m_used_table.empty() && "Error: Alpha Table Not Built!");
 
-ImageRect::ImageRect(fipImage* image, Image* image_info, ImageRect* parent, Position rel_pos /*= Position(0, 0)*/)
-: m_image(image)
-, m_image_info(image_info)
-, m_parent(parent) 
-, m_is_rotated(false)
-{
-	assert(image && "Image must not NULL!");
-	m_zone.size = Size(image->getWidth(), image->getHeight());
-	//_initCropUnusedBorder();
-	m_zone.pos.add(rel_pos);
-}
+	int x0 = zone.pos.x, x1 = zone.pos.x + zone.size.width;
+	int y0 = zone.pos.y, y1 = zone.pos.y + zone.size.height;
 
-ImageRect::~ImageRect()
-{
-	for (auto child : m_children)
+	// whole words inside the zone from the tables
+	int full_begin = (x0 + 63) >> 6;
+	int full_end = x1 >> 6;
+	if (full_begin < full_end)
+	{
+		int stride = m_plane_pitch + 1;
+		int left_top = y0 * stride + full_begin;
+		int right_top = y0 * stride + full_end;
+		int left_bottom = y1 * stride + full_begin;
+		int right_bottom = y1 * stride + full_end;
+
+		used = m_used_table[right_bottom] - m_used_table[right_top] 
+			- m_used_table[left_bottom] + m_used_table[left_top];
+		opacity = m_opacity_table[right_bottom] - m_opacity_table[right_top] 
+			- m_opacity_table[left_bottom] + m_opacity_table[left_top];
+	}
+
+	// partial words at the edges, masked popcount per line
+	int left_word = x0 >> 6, right_word = full_end;
+	AlphaWord left_mask = 0, right_mask = 0;
+	if (full_begin > full_end)
+	{
+		left_mask = bits_between(x0 & 63, x1 & 63);
+	}
+	else
 	{
-		delete child;
+		if (x0 & 63)
+			left_mask = bits_between(x0 & 63, 64);
+		if (x1 & 63)
+			right_mask = bits_between(0, x1 & 63);
 	}
-	m_children.clear();
 
-	assert(m_image);
-	delete m_image;
-	m_image = NULL;
+	if (!left_mask && !right_mask)
+		return;
+
+	for (int y = y0; y < y1; y++)
+	{
+		const AlphaWord* used_line = &m_used_plane[y * m_plane_pitch];
+		const AlphaWord* opacity_line = &m_opacity_plane[y * m_plane_pitch];
+		if (left_mask)
+		{
+			used += popcount64(used_line[left_word] & left_mask);
+			opacity += popcount64(opacity_line[left_word] & left_mask);
+		}
+		if (right_mask)
+		{
+			used += popcount64(used_line[right_word] & right_mask);
+			opacity += popcount64(opacity_line[right_word] & right_mask);
+		}
+	}
 }
 
-float ImageRect::getSolidPixelsRatio()
+bool Image::getUsedBounds(const Zone& zone, Zone& bounds)
 {
-	assert(m_image && "Error: Image is NULL!");
+	if (zone.size.width <= 0 || zone.size.height <= 0)
+		return false;
 
-	unsigned int used = 0, unused = 0, opacity = 0, total = 0;
-	_getPixelCount(used, unused, opacity, total);
+	if (m_is_opaque)
+	{
+		bounds = Zone(Position(0, 0), zone.size);
+		return true;
+	}
+	assert(!m_used_plane.empty() && "Error: Alpha Planes Not Built!");
 
-	return used * 1.0f / total;
-}
+	int x0 = zone.pos.x, x1 = zone.pos.x + zone.size.width;
+	int first_word = x0 >> 6, last_word = (x1 - 1) >> 6;
+	AlphaWord first_mask = bits_between(x0 & 63, 64);
+	AlphaWord last_mask = bits_between(0, ((x1 - 1) & 63) + 1);
 
-float ImageRect::getOpacityPixelsRatio()
-{
-	assert(m_image && "Error: Image is NULL!");
+	auto masked_word = [=](const AlphaWord* line, int w) -> AlphaWord
+	{
+		AlphaWord word = line[w];
+		if (w == first_word)
+			word &= first_mask;
+		if (w == last_word)
+			word &= last_mask;
+		return word;
+	};
+
+	int top = -1, bottom = -1, left = x1, right = x0 - 1;
+	for (int y = zone.pos.y; y < zone.pos.y + zone.size.height; y++)
+	{
+		const AlphaWord* line = &m_used_plane[y * m_plane_pitch];
+
+		// first & last used word of the line
+		int first = first_word;
+		while (first <= last_word && !masked_word(line, first))
+			first++;
+		if (first > last_word)
+			continue;
+		int last = last_word;
+		while (!masked_word(line, last))
+			last--;
+
+		left = min(left, first * 64 + bit_scan_forward64(masked_word(line, first)));
+		right = max(right, last * 64 + bit_scan_reverse64(masked_word(line, last)));
+		top = top < 0 ? y : top;
+		bottom = y;
+	}
 
-	unsigned int used = 0, unused = 0, opacity = 0, total = 0;
-	_getPixelCount(used, unused, opacity, total);
+	if (top < 0)
+		return false;
 
-	return opacity * 1.0f / total;
+	bounds = Zone(Position(left - x0, top - zone.pos.y), Size(right - left + 1, bottom - top + 1));
+	return true;
 }
 
-float ImageRect::getSavedAreaRatio()
+void Image::getUsedProjections(const Zone& zone, std::vector<int>& row_first, std::vector<int>& row_last, 
+	std::vector<int>& col_first, std::vector<int>& col_last)
 {
-	RectList rects;
-	getLeafRects(rects);
-
-	if ( rects.empty() )
-		return 0.0f;
+	int width = max(zone.size.width, 0), height = max(zone.size.height, 0);
+	row_first.assign(height, -1);
+	row_last.assign(height, -1);
+	col_first.assign(width, -1);
+	col_last.assign(width, -1);
+	if (width == 0 || height == 0)
+		return;
 
-	unsigned int sub_rect_areas = 0;
-	for (auto rect: rects)
+	if (m_is_opaque)
 	{
-		sub_rect_areas += rect->getRelativeZone().size.area();
+		row_first.assign(height, 0);
+		row_last.assign(height, width - 1);
+		col_first.assign(width, 0);
+		col_last.assign(width, height - 1);
+		return;
 	}
+	assert(!m_used_plane.empty() && "Error: Alpha Planes Not Built!");
 
-	assert(sub_rect_areas <= getRelativeZone().size.area());
+	int x0 = zone.pos.x, x1 = zone.pos.x + width;
+	int first_word = x0 >> 6, last_word = (x1 - 1) >> 6;
+	int word_num = last_word - first_word + 1;
+	AlphaWord first_mask = bits_between(x0 & 63, 64);
+	AlphaWord last_mask = bits_between(0, ((x1 - 1) & 63) + 1);
 
-	return 1.0f - 1.0f * sub_rect_areas / getRelativeZone().size.area();
-}
+	auto masked_word = [=](const AlphaWord* line, int w) -> AlphaWord
+	{
+		AlphaWord word = line[w];
+		if (w == first_word)
+			word &= first_mask;
+		if (w == last_word)
+			word &= last_mask;
+		return word;
+	};
+
+	// top-down: row extents, and the first row of a column at its first new bit;
+	// bottom-up: the last row of a column likewise, so each column bit is scanned twice at most
+	std::vector<AlphaWord> seen(word_num, 0);
+	for (int y = 0; y < height; y++)
+	{
+		const AlphaWord* line = &m_used_plane[(zone.pos.y + y) * m_plane_pitch];
+		for (int w = first_word; w <= last_word; w++)
+		{
+			AlphaWord word = masked_word(line, w);
+			if (!word)
+				continue;
 
-bool ImageRect::isFullTransparent()
-{
-	assert(m_image && "Image is NULL!");
+			if (row_first[y] < 0)
+				row_first[y] = w * 64 + bit_scan_forward64(word) - x0;
+			row_last[y] = w * 64 + bit_scan_reverse64(word) - x0;
 
-	// traversal pixels
-	if (m_zone.isZero())
-		return true;
+			for (AlphaWord fresh = word & ~seen[w - first_word]; fresh; fresh &= fresh - 1)
+			{
+				col_first[w * 64 + bit_scan_forward64(fresh) - x0] = y;
+			}
+			seen[w - first_word] |= word;
+		}
+	}
 
-	unsigned int used = 0, unused = 0, opacity = 0, total = 0;
-	_getPixelCount(used, unused, opacity, total);
+	seen.assign(word_num, 0);
+	for (int y = height - 1; y >= 0; y--)
+	{
+		if (row_first[y] < 0)
+			continue;
 
-	return used == 0;
+		const AlphaWord* line = &m_used_plane[(zone.pos.y + y) * m_plane_pitch];
+		for (int w = first_word; w <= last_word; w++)
+		{
+			AlphaWord fresh = masked_word(line, w) & ~seen[w - first_word];
+			seen[w - first_word] |= fresh;
+			for (; fresh; fresh &= fresh - 1)
+			{
+				col_last[w * 64 + bit_scan_forward64(fresh) - x0] = y;
+			}
+		}
+	}
 }
 
-void ImageRect::rotate()
+PixelView Image::getView(const Zone& zone)
 {
-	assert(isLeafRect() && "Error: Must Rotate a Leaf Rect!");
-	m_image->rotate(getImageInfo()->getOptions().rotate_degress);
-	m_is_rotated = true;
+	assert(m_raw_image && "Error: Raw Image is NULL!");
+
+	PixelView view;
+	view.bytespp = m_raw_image->getLine() / m_raw_image->getWidth();
+	view.pitch = -(int)m_raw_image->getScanWidth();
+	view.bits = m_raw_image->getScanLine(m_raw_size.height - zone.pos.y - 1) + zone.pos.x * view.bytespp;
+	view.size = zone.size;
+	return view;
 }
 
-int ImageRect::getDepth()
+bool Image::_scanOpaque()
 {
-	int depth = 0;
-	ImageRect* parent = getParent();
-	while (parent)
+	PixelView view = getView(Zone(Position(0, 0), m_raw_size));
+	const AlphaKernel* kernel = get_alpha_kernel(view.bytespp * 8);
+	assert(kernel && "Error: Unsupported Pixel Layout!");
+
+	// stops at the first line with a pixel alpha < 255
+	unsigned int used = 0, opacity = 0;
+	for (int y = 0; y < view.size.height; y++)
 	{
-		depth++;
-		parent = parent->getParent();
+		kernel->count(view.getLine(y), view.size.width, 0, used, opacity);
+		if (opacity < (unsigned int)view.size.width)
+			return false;
 	}
-
-	return depth;
+	return true;
 }
 
-void ImageRect::getLeafRects(RectList& rects)
+void Image::_buildAlphaPlanes()
 {
-	if (isLeafRect())
+	int height = m_raw_size.height;
+	m_plane_pitch = (m_raw_size.width + 63) >> 6;
+	int stride = m_plane_pitch + 1;
+
+	m_used_plane.assign(m_plane_pitch * height, 0);
+	m_opacity_plane.assign(m_plane_pitch * height, 0);
+	m_used_table.assign(stride * (height + 1), 0);
+	m_opacity_table.assign(stride * (height + 1), 0);
+
+	// bands of lines are summed independently, then offset by the lines above
+	TaskScheduler* scheduler = getOptions().scheduler;
+	int band_num = scheduler ? (scheduler->getThreadCount() + 1) * 4 : 1;
+	band_num = min(band_num, max(1, height / ICROPPER_ALPHA_BAND_MIN_LINES));
+	int band_height = (height + band_num - 1) / band_num;
+	std::vector<unsigned int> zero_line(stride, 0);
+
+	TaskGroup group(band_num > 1 ? scheduler : NULL);
+	for (int top = 0; top < height; top += band_height)
 	{
-		rects.push_back(this);
+		int bottom = min(top + band_height, height);
+		group.spawn([this, top, bottom, &zero_line]()
+			{
+				_buildAlphaLines(top, bottom, &zero_line[0]);
+			}
+		);
 	}
-	else
+	group.wait();
+
+	if (band_height >= height)
+		return;
+
+	// band offset: total of the lines above, accumulated before any band is fixed
+	std::vector<std::vector<unsigned int> > used_offsets(1, zero_line);
+	std::vector<std::vector<unsigned int> > opacity_offsets(1, zero_line);
+	for (int top = band_height; top < height; top += band_height)
 	{
-		for (auto child: m_children)
+		const unsigned int* used_last = &m_used_table[top * stride];
+		const unsigned int* opacity_last = &m_opacity_table[top * stride];
+		std::vector<unsigned int> used_offset(used_offsets.back());
+		std::vector<unsigned int> opacity_offset(opacity_offsets.back());
+		for (int x = 0; x < stride; x++)
 		{
-			child->getLeafRects(rects);
+			used_offset[x] += used_last[x];
+			opacity_offset[x] += opacity_last[x];
 		}
+		used_offsets.push_back(used_offset);
+		opacity_offsets.push_back(opacity_offset);
 	}
-}
 
-Zone ImageRect::getAbsZone()
-{
-	if (isRootRect())
+	for (int band = 1; band < (int)used_offsets.size(); band++)
 	{
-		return m_zone;
+		int top = band * band_height;
+		int bottom = min(top + band_height, height);
+		const unsigned int* used_offset = &used_offsets[band][0];
+		const unsigned int* opacity_offset = &opacity_offsets[band][0];
+		group.spawn([this, top, bottom, stride, used_offset, opacity_offset]()
+			{
+				for (int y = top + 1; y <= bottom; y++)
+				{
+					unsigned int* used_row = &m_used_table[y * stride];
+					unsigned int* opacity_row = &m_opacity_table[y * stride];
+					for (int x = 0; x < stride; x++)
+					{
+						used_row[x] += used_offset[x];
+						opacity_row[x] += opacity_offset[x];
+					}
+				}
+			}
+		);
 	}
-
-	Zone abs_zone = m_zone;
-	Zone parent_zone = getParent()->getAbsZone();
-	abs_zone.pos.add(parent_zone.pos);
-
-	return abs_zone;
+	group.wait();
 }
 
-void ImageRect::cropWithFixedSize(Size block_size)
+void Image::_buildAlphaLines(int begin, int end, const unsigned int* zero_line)
 {
-	assert(isLeafRect() && "Error: Can Only Crop a Leaf Rect!");
-	assert(!isRotated() && "Error: Can not Crop a Rotated Rect!");
+	int stride = m_plane_pitch + 1;
+	PixelView view = getView(Zone(Position(0, 0), m_raw_size));
+	const AlphaKernel* kernel = get_alpha_kernel(view.bytespp * 8);
+	assert(kernel && "Error: Unsupported Pixel Layout!");
+	assert(getOptions().alpha_threshold >= 0 && getOptions().alpha_threshold < 255 && "Error: Invalid Alpha Threshold!");
 
-	for (int y = 0; y < m_zone.size.height; y+=block_size.height)
+	BYTE threshold = (BYTE)getOptions().alpha_threshold;
+	bool clear = getOptions().alpha_clear && threshold > 0 && view.bytespp != 3;
+	int alpha_offset = view.bytespp == 4 ? FI_RGBA_ALPHA : 0;
+
+	for (int y = begin; y < end; y++)
 	{
-		for (int x = 0; x < m_zone.size.width; x+=block_size.width)
+		if (clear)
 		{
-			int width = min(block_size.width, m_zone.size.width - x);
-			int height = min(block_size.height, m_zone.size.height - y);
-
-			fipImage* sub_img = new fipImage(FIT_BITMAP, width, height);
-			m_image->copySubImage(*sub_img, x, y, x+width, y+height);
-
-			ImageRect* sub_rect = new ImageRect(sub_img, m_image_info, this, Position(x, y));
-			if (sub_rect->isFullTransparent()) // invalid rect
+			BYTE* bits = view.getLine(y);
+			for (int x = 0; x < view.size.width; x++, bits += view.bytespp)
 			{
-				delete sub_rect;
-				continue;
+				if (bits[alpha_offset] <= threshold)
+					memset(bits, 0, view.bytespp);
 			}
+		}
 
-			sub_rect->cropHalving();
-			m_children.push_back(sub_rect);
+		// the only pass over the pixels, later analysis reads the planes
+		AlphaWord* used_line = &m_used_plane[y * m_plane_pitch];
+		AlphaWord* opacity_line = &m_opacity_plane[y * m_plane_pitch];
+		kernel->pack(view.getLine(y), view.size.width, threshold, used_line, opacity_line);
+
+		const unsigned int* used_above = y == begin ? zero_line : &m_used_table[y * stride];
+		const unsigned int* opacity_above = y == begin ? zero_line : &m_opacity_table[y * stride];
+		unsigned int* used_row = &m_used_table[(y + 1) * stride];
+		unsigned int* opacity_row = &m_opacity_table[(y + 1) * stride];
+		unsigned int used_sum = 0;
+		unsigned int opacity_sum = 0;
+		for (int w = 0; w < m_plane_pitch; w++)
+		{
+			used_sum += popcount64(used_line[w]);
+			opacity_sum += popcount64(opacity_line[w]);
+			used_row[w+1] = used_above[w+1] + used_sum;
+			opacity_row[w+1] = opacity_above[w+1] + opacity_sum;
 		}
 	}
 }
 
-void ImageRect::cropHalving()
+// a merge candidate of 2 leaves, least growth first
+struct MergePair
 {
-	assert(!isRotated() && "Error: Can not Crop a Rotated Rect!");
+	MergePair(float _growth, int _first, int _second, int _first_version, int _second_version)
+		: growth(_growth), first(_first), second(_second), first_version(_first_version), second_version(_second_version) {}
 
-	// no need to crop
-	if (getDepth() >= getImageInfo()->getOptions().crop_depth
-		|| getSolidPixelsRatio() >= getImageInfo()->getOptions().crop_usage_ratio
-		|| m_zone.size.area() <= getImageInfo()->getOptions().min_area)
-		return;
+	inline bool operator<(const MergePair& rhs) const
+	{
+		// reversed for the max-heap of std::priority_queue
+		if (growth != rhs.growth)
+			return growth > rhs.growth;
+		return first != rhs.first ? first > rhs.first : second > rhs.second;
+	}
 
-	// crop half the size
-	Size crop_size((m_zone.size.width+1) >> 1, (m_zone.size.height+1) >> 1);
-	cropWithFixedSize(crop_size);
+	float growth;
+	int first;
+	int second;
+	int first_version;
+	int second_version;
+};
+
+inline Zone union_zone(const Zone& lhs, const Zone& rhs)
+{
+	Position pos(min(lhs.pos.x, rhs.pos.x), min(lhs.pos.y, rhs.pos.y));
+	Size size(max(lhs.pos.x + lhs.size.width, rhs.pos.x + rhs.size.width) - pos.x, 
+		max(lhs.pos.y + lhs.size.height, rhs.pos.y + rhs.size.height) - pos.y);
+	return Zone(pos, size);
 }
 
-void ImageRect::_initCropUnusedBorder()
+inline bool is_zone_overlapped(const Zone& lhs, const Zone& rhs, int gap = 0)
+{
+	return lhs.pos.x < rhs.pos.x + rhs.size.width + gap && rhs.pos.x < lhs.pos.x + lhs.size.width + gap
+		&& lhs.pos.y < rhs.pos.y + rhs.size.height + gap && rhs.pos.y < lhs.pos.y + lhs.size.height + gap;
+}
+
+void Image::_mergeRects()
 {
-	Position left_top;
-	Position bottom_right;
-	left_top.x = m_image->getWidth() - 1;
-	left_top.y = m_image->getHeight() - 1;
-	bottom_right.x = 0;
-	bottom_right.y = 0;
+	int rect_num = (int)m_rects.size();
+	if (rect_num < 2)
+		return;
+
+	float max_growth = getOptions().merge_growth;
+	int max_size = getOptions().merge_max_size;
 
-	traversal_pixels(m_image,
-			[&](BYTE* bits, unsigned int x, unsigned int y) 
+	// merged leaf i covers zones[i], holding areas[i] pixels of the cropped leaves
+	std::vector<Zone> zones(rect_num);
+	std::vector<unsigned int> areas(rect_num);
+	std::vector<int> versions(rect_num, 0);
+	std::vector<bool> alive(rect_num, true);
+	for (int i = 0; i < rect_num; i++)
+	{
+		zones[i] = m_rects[i]->getAbsZone();
+		areas[i] = zones[i].size.area();
+	}
+
+	// buckets of a uniform grid, a leaf is in every bucket it overlaps
+	int cell = max(16, max(getOptions().block_size.width, getOptions().block_size.height));
+	int grid_cols = (m_raw_size.width + cell - 1) / cell;
+	int grid_rows = (m_raw_size.height + cell - 1) / cell;
+	std::vector<std::vector<int> > buckets(grid_cols * grid_rows);
+	auto for_each_bucket = [&](const Zone& zone, int gap, std::function<void(std::vector<int>&)> func)
+	{
+		int x0 = max(0, (zone.pos.x - gap) / cell);
+		int y0 = max(0, (zone.pos.y - gap) / cell);
+		int x1 = min(grid_cols - 1, (zone.pos.x + zone.size.width + gap - 1) / cell);
+		int y1 = min(grid_rows - 1, (zone.pos.y + zone.size.height + gap - 1) / cell);
+		for (int y = y0; y <= y1; y++)
+		{
+			for (int x = x0; x <= x1; x++)
+			{
+				func(buckets[y * grid_cols + x]);
+			}
+		}
+	};
+	std::vector<int> stamps(rect_num, -1);
+	int stamp = 0;
+	auto query = [&](const Zone& zone, int gap, std::vector<int>& found)
+	{
+		found.clear();
+		stamp++;
+		for_each_bucket(zone, gap, [&](std::vector<int>& bucket)
 			{
-				if (bits[FI_RGBA_ALPHA])
+				for (auto idx: bucket)
 				{
-					left_top.x = min(left_top.x, (int)x);
-					left_top.y = min(left_top.y, (int)y);
-					bottom_right.x = max(bottom_right.x, (int)x);
-					bottom_right.y = max(bottom_right.y, (int)y);
+					if (alive[idx] && stamps[idx] != stamp && is_zone_overlapped(zone, zones[idx], gap))
+					{
+						stamps[idx] = stamp;
+						found.push_back(idx);
+					}
 				}
 			}
 		);
+	};
 
-	m_zone.pos = left_top;
-	m_zone.size = Size(bottom_right.x - left_top.x + 1, bottom_right.y - left_top.y + 1);
+	std::priority_queue<MergePair> pairs;
+	std::vector<int> found;
+	auto push_pairs = [&](int idx)
+	{
+		query(zones[idx], ICROPPER_MERGE_NEIGHBOR_GAP, found);
+		for (auto other: found)
+		{
+			if (other == idx)
+				continue;
+			Zone merged = union_zone(zones[idx], zones[other]);
+			unsigned int area = areas[idx] + areas[other];
+			float growth = 1.0f * (merged.size.area() - area) / area;
+			if (growth <= max_growth && merged.size.width <= max_size && merged.size.height <= max_size)
+				pairs.push(MergePair(growth, min(idx, other), max(idx, other), versions[min(idx, other)], versions[max(idx, other)]));
+		}
+	};
 
-	// if have unused border
-	if (left_top == Position(0,0) 
-		&& bottom_right.x == m_image->getWidth() - 1
-		&& bottom_right.y == m_image->getHeight() - 1)
+	for (int i = 0; i < rect_num; i++)
 	{
-		// do nothing
+		for_each_bucket(zones[i], 0, [i](std::vector<int>& bucket) { bucket.push_back(i); });
 	}
-	else
+	for (int i = 0; i < rect_num; i++)
 	{
-		// crop border
-		BOOL retv = m_image->crop(left_top.x, left_top.y, bottom_right.x + 1, bottom_right.y + 1);
-		assert(retv && "Crop Border Failed!");
+		push_pairs(i);
 	}
-	
-}
 
-void ImageRect::_getPixelCount(unsigned int& used, unsigned int& unused, unsigned int& opacity, unsigned int& total)
-{
-	assert(m_image && "Image is NULL!");
-	used = 0;
-	unused = 0;
-	opacity = 0;
-	total = m_image->getHeight() * m_image->getWidth();
+	// greedy: merge the pair growing least, leaves overlapped by the union are absorbed too
+	std::vector<int> members;
+	while (!pairs.empty())
+	{
+		MergePair pair = pairs.top();
+		pairs.pop();
+		if (!alive[pair.first] || !alive[pair.second] 
+			|| versions[pair.first] != pair.first_version || versions[pair.second] != pair.second_version)
+			continue;
+
+		Zone merged = union_zone(zones[pair.first], zones[pair.second]);
+		unsigned int area = areas[pair.first] + areas[pair.second];
+		members.clear();
+		members.push_back(pair.second);
+		for (bool absorbed = true; absorbed; )
+		{
+			absorbed = false;
+			query(merged, 0, found);
+			for (auto idx: found)
+			{
+				if (idx == pair.first || std::find(members.begin(), members.end(), idx) != members.end())
+					continue;
+				members.push_back(idx);
+				area += areas[idx];
+				merged = union_zone(merged, zones[idx]);
+				absorbed = true;
+			}
+		}
+
+		if (merged.size.area() - area > max_growth * area 
+			|| merged.size.width > max_size || merged.size.height > max_size)
+			continue;
 
-	traversal_pixels(m_image,
-			[&](BYTE* bits, unsigned int, unsigned int) 
+		for (auto idx: members)
+		{
+			alive[idx] = false;
+		}
+		zones[pair.first] = merged;
+		areas[pair.first] = area;
+		versions[pair.first]++;
+		int merged_idx = pair.first;
+		for_each_bucket(merged, 0, [merged_idx](std::vector<int>& bucket)
 			{
-				if (/*bits[FI_RGBA_RED] || bits[FI_RGBA_GREEN] || bits[FI_RGBA_BLUE] || */bits[FI_RGBA_ALPHA])
-				{
-					used++;
-					if (bits[FI_RGBA_ALPHA] == 255)
-						opacity++;
-				}
-				else
-				{
-					unused++;
-				}
+				if (std::find(bucket.begin(), bucket.end(), merged_idx) == bucket.end())
+					bucket.push_back(merged_idx);
 			}
 		);
-	
-	assert(total == (used + unused) && "Error: total != (used + unused) !!");
-}
+		push_pairs(merged_idx);
+	}
 
+	// merged rects are out of the tree, the root is at (0, 0) so relative zones are absolute
+	RectList rects;
+	for (int i = 0; i < rect_num; i++)
+	{
+		if (!alive[i])
+			continue;
+		if (versions[i] == 0)
+			rects.push_back(m_rects[i]);
+		else
+			rects.push_back(new (m_arena.alloc(1)) ImageRect(this, m_root_rect, zones[i]));
+	}
+	m_rects.swap(rects);
+}
 
 //////////////////////////////////////////////////////////////////////////
 
-Compositor::Compositor()
-{
-}
 
-Compositor::~Compositor()
+ImageRect::ImageRect(Image* image_info, ImageRect* parent, Zone rel_zone)
+: m_zone(rel_zone)
+, m_abs_zone(rel_zone)
+, m_depth(0)
+, m_image_info(image_info)
+, m_parent(parent) 
+, m_is_rotated(false)
+, m_children(NULL)
+, m_child_num(0)
 {
-	_clearSlices();
-	_clearTextures();
-	_clearImages();
+	assert(image_info && "Image must not NULL!");
+	if (parent)
+	{
+		m_abs_zone.pos.add(parent->getAbsZone().pos);
+		m_depth = parent->getDepth() + 1;
+	}
 }
 
-void Compositor::reset()
+PixelView ImageRect::getView()
 {
-	m_rects.clear();
-	_clearSlices();
-	_clearTextures();
-	_clearImages();
+	return m_image_info->getView(getAbsZone());
 }
 
-bool Compositor::addImage(Image* image)
+bool ImageRect::copyToImage(fipImage& image)
 {
-	assert(image && "Image Must Not NULL!");
-	if (image->getRects().empty()) // maybe not cropped yet!
-		return false;
-	if (m_image_slices.find(image) != m_image_slices.end()) // image already add to compositor 
+	Zone abs_zone = getAbsZone();
+	fipImage* raw_image = m_image_info->getRawImage();
+	assert(raw_image && "Error: Raw Image is NULL!");
+
+	if (!raw_image->copySubImage(image, abs_zone.pos.x, abs_zone.pos.y, 
+		abs_zone.pos.x + abs_zone.size.width, abs_zone.pos.y + abs_zone.size.height))
 		return false;
-	m_image_slices.insert(ImageSlices::value_type(image, new SliceArray));
-	m_rects.insert(m_rects.end(), image->getRects().begin(), image->getRects().end());
 
-	if (m_file_prefix.empty())
-	{
-		m_file_prefix = image->getFileName();
-		m_file_prefix = m_file_prefix.substr(0, m_file_prefix.find_last_of('.'));
-	}
+	if (isRotated())
+		return image.rotate(getImageInfo()->getOptions().rotate_degress) == TRUE;
 
 	return true;
 }
 
-bool Compositor::composit()
+float ImageRect::getSolidPixelsRatio()
+{
+
+	unsigned int used = 0, unused = 0, opacity = 0, total = 0;
+	_getPixelCount(used, unused, opacity, total);
+
+	return used * 1.0f / total;
+}
+
+float ImageRect::getOpacityPixelsRatio()
+{
+
+	unsigned int used = 0, unused = 0, opacity = 0, total = 0;
+	_getPixelCount(used, unused, opacity, total);
+
+	return opacity * 1.0f / total;
+}
+
+float ImageRect::getSavedAreaRatio()
+{
+	RectList rects;
+	getLeafRects(rects);
+
+	if ( rects.empty() )
+		return 0.0f;
+
+	unsigned int sub_rect_areas = 0;
+	for (auto rect: rects)
+	{
+		sub_rect_areas += rect->getRelativeZone().size.area();
+	}
+
+	assert(sub_rect_areas <= getRelativeZone().size.area());
+
+	return 1.0f - 1.0f * sub_rect_areas / getRelativeZone().size.area();
+}
+
+bool ImageRect::isFullTransparent()
+{
+	// traversal pixels
+	if (m_zone.isZero())
+		return true;
+
+	unsigned int used = 0, unused = 0, opacity = 0, total = 0;
+	_getPixelCount(used, unused, opacity, total);
+
+	return used == 0;
+}
+
+bool ImageRect::isFullOpaque()
+{
+	if (m_zone.isZero())
+		return false;
+
+	unsigned int used = 0, unused = 0, opacity = 0, total = 0;
+	_getPixelCount(used, unused, opacity, total);
+
+	return opacity == total;
+}
+
+void ImageRect::rotate()
+{
+	assert(isLeafRect() && "Error: Must Rotate a Leaf Rect!");
+	// pixels are rotated when copied out
+	m_is_rotated = true;
+}
+
+void ImageRect::getLeafRects(RectList& rects)
+{
+	if (isLeafRect())
+	{
+		rects.push_back(this);
+	}
+	else
+	{
+		for (auto& child: getChildren())
+		{
+			child.getLeafRects(rects);
+		}
+	}
+}
+
+void ImageRect::cropWithFixedSize(Size block_size)
+{
+	assert(isLeafRect() && "Error: Can Only Crop a Leaf Rect!");
+	assert(!isRotated() && "Error: Can not Crop a Rotated Rect!");
+
+	// transparent blocks are dropped before allocating, so the children are one contiguous run
+	std::vector<Zone> blocks;
+	for (int y = 0; y < m_zone.size.height; y+=block_size.height)
+	{
+		for (int x = 0; x < m_zone.size.width; x+=block_size.width)
+		{
+			int width = min(block_size.width, m_zone.size.width - x);
+			int height = min(block_size.height, m_zone.size.height - y);
+
+			Zone abs_block(Position(m_abs_zone.pos.x + x, m_abs_zone.pos.y + y), Size(width, height));
+			if (m_image_info->getUsedPixelCount(abs_block) == 0) // invalid rect
+				continue;
+
+			blocks.push_back(Zone(Position(x, y), Size(width, height)));
+		}
+	}
+
+	// blocks of opaque images are final
+	_cropChildren(blocks, !m_image_info->isOpaque());
+}
+
+void ImageRect::cropHalving()
+{
+	assert(!isRotated() && "Error: Can not Crop a Rotated Rect!");
+
+	CropOptions& options = getImageInfo()->getOptions();
+
+	// optimal split covers the whole block at once without the thresholds, its leaves are tight
+	if (options.split_mode == kCropSplitOptimal)
+	{
+		if (!_cropOptimal())
+			_initCropUnusedBorder();
+		return;
+	}
+
+	// a quarter split is 2 guillotine cuts
+	int crop_depth = options.split_mode == kCropSplitGuillotine ? options.crop_depth * 2 - 1 : options.crop_depth;
+
+	// no need to crop, a leaf
+	if (getDepth() >= crop_depth
+		|| getSolidPixelsRatio() >= options.crop_usage_ratio
+		|| m_zone.size.area() <= options.min_area)
+	{
+		if (options.trim_leaves)
+			_initCropUnusedBorder();
+		return;
+	}
+
+	if (options.split_mode == kCropSplitGuillotine)
+	{
+		if (!_cropGuillotine() && options.trim_leaves)
+			_initCropUnusedBorder();
+		return;
+	}
+
+	// crop half the size
+	Size crop_size((m_zone.size.width+1) >> 1, (m_zone.size.height+1) >> 1);
+	cropWithFixedSize(crop_size);
+}
+
+// bounds of used pixels of the lines on one side of a cut, inclusive
+struct CutBounds
+{
+	CutBounds() : line_first(-1), line_last(-1), across_first(0), across_last(-1) {}
+
+	inline bool isEmpty() const { return line_first < 0; }
+	inline unsigned int area() const { return isEmpty() ? 0 : (line_last - line_first + 1) * (across_last - across_first + 1); }
+
+	inline void add(int line, int first, int last)
+	{
+		if (first < 0)
+			return;
+
+		if (isEmpty())
+		{
+			line_first = line_last = line;
+			across_first = first;
+			across_last = last;
+			return;
+		}
+
+		line_first = min(line_first, line);
+		line_last = max(line_last, line);
+		across_first = min(across_first, first);
+		across_last = max(across_last, last);
+	}
+
+	int line_first;
+	int line_last;
+	int across_first;
+	int across_last;
+};
+
+// cut lines [0, n) where the bounds of the 2 sides are smallest, only if less than best_area;
+// first / last: extent of used pixels across each line, -1 reps transparent
+static bool find_guillotine_cut(const std::vector<int>& first, const std::vector<int>& last, 
+	unsigned int& best_area, CutBounds& best_head, CutBounds& best_tail)
+{
+	int n = (int)first.size();
+	std::vector<CutBounds> tails(n + 1);
+	for (int k = n - 1; k >= 0; k--)
+	{
+		tails[k] = tails[k+1];
+		tails[k].add(k, first[k], last[k]);
+	}
+
+	bool found = false;
+	int best_cut = 0;
+	CutBounds head;
+	for (int k = 1; k < n; k++)
+	{
+		head.add(k - 1, first[k-1], last[k-1]);
+		if (head.isEmpty() || tails[k].isEmpty())
+			continue;
+
+		// equal areas go to the most balanced cut, the widest gap is in the middle of it
+		unsigned int area = head.area() + tails[k].area();
+		if (area < best_area || (found && area == best_area && abs(n - 2 * k) < abs(n - 2 * best_cut)))
+		{
+			found = true;
+			best_cut = k;
+			best_area = area;
+			best_head = head;
+			best_tail = tails[k];
+		}
+	}
+
+	return found;
+}
+
+bool ImageRect::_cropGuillotine()
+{
+	assert(isLeafRect() && "Error: Can Only Crop a Leaf Rect!");
+
+	// alpha projections: extents of used pixels of each row & column
+	std::vector<int> row_first, row_last, col_first, col_last;
+	m_image_info->getUsedProjections(m_abs_zone, row_first, row_last, col_first, col_last);
+	CutBounds bounds;
+	for (int y = 0; y < (int)row_first.size(); y++)
+	{
+		bounds.add(y, row_first[y], row_last[y]);
+	}
+
+	// a cut must save area against the bounds of the whole rect
+	unsigned int best_area = bounds.area();
+	CutBounds head, tail;
+	std::vector<Zone> zones;
+	if (find_guillotine_cut(row_first, row_last, best_area, head, tail))
+	{
+		zones.clear();
+		zones.push_back(Zone(Position(head.across_first, head.line_first), 
+			Size(head.across_last - head.across_first + 1, head.line_last - head.line_first + 1)));
+		zones.push_back(Zone(Position(tail.across_first, tail.line_first), 
+			Size(tail.across_last - tail.across_first + 1, tail.line_last - tail.line_first + 1)));
+	}
+	if (find_guillotine_cut(col_first, col_last, best_area, head, tail))
+	{
+		zones.clear();
+		zones.push_back(Zone(Position(head.line_first, head.across_first), 
+			Size(head.line_last - head.line_first + 1, head.across_last - head.across_first + 1)));
+		zones.push_back(Zone(Position(tail.line_first, tail.across_first), 
+			Size(tail.line_last - tail.line_first + 1, tail.across_last - tail.across_first + 1)));
+	}
+
+	if (zones.empty())
+		return false;
+
+	_cropChildren(zones);
+	return true;
+}
+
+// smallest zone holding both, zero size reps empty
+static Zone join_bounds(const Zone& lhs, const Zone& rhs)
+{
+	if (lhs.size.width == 0 || lhs.size.height == 0)
+		return rhs;
+	if (rhs.size.width == 0 || rhs.size.height == 0)
+		return lhs;
+
+	int left = min(lhs.pos.x, rhs.pos.x), top = min(lhs.pos.y, rhs.pos.y);
+	int right = max(lhs.pos.x + lhs.size.width, rhs.pos.x + rhs.size.width);
+	int bottom = max(lhs.pos.y + lhs.size.height, rhs.pos.y + rhs.size.height);
+	return Zone(Position(left, top), Size(right - left, bottom - top));
+}
+
+bool ImageRect::_cropOptimal()
+{
+	assert(isLeafRect() && "Error: Can Only Crop a Leaf Rect!");
+
+	CropOptions& options = getImageInfo()->getOptions();
+	int width = m_abs_zone.size.width;
+	int height = m_abs_zone.size.height;
+	int cell_size = max(1, options.cell_size);
+	cell_size = max(cell_size, (max(width, height) + ICROPPER_OPTIMAL_MAX_CELLS - 1) / ICROPPER_OPTIMAL_MAX_CELLS);
+	int cols = (width + cell_size - 1) / cell_size;
+	int rows = (height + cell_size - 1) / cell_size;
+
+	// state: cell range [x0, x1) x [y0, y1); choice: 0 reps a leaf, > 0 reps a column cut at x0 + choice, < 0 a row cut
+	auto state = [cols, rows](int x0, int x1, int y0, int y1) -> int
+	{
+		return ((x0 * (cols + 1) + x1) * rows + y0) * (rows + 1) + y1;
+	};
+	auto cell_zone = [this, cell_size, width, height](int x0, int x1, int y0, int y1) -> Zone
+	{
+		Position pos(x0 * cell_size, y0 * cell_size);
+		Size size(min(x1 * cell_size, width) - pos.x, min(y1 * cell_size, height) - pos.y);
+		pos.add(m_abs_zone.pos);
+		return Zone(pos, size);
+	};
+
+	int state_num = cols * (cols + 1) * rows * (rows + 1);
+	std::vector<unsigned int> costs(state_num, 0);
+	std::vector<int> choices(state_num, 0);
+	std::vector<Zone> leaf_bounds(state_num);	// absolute used bounds of a range, zero size reps transparent
+
+	// smaller ranges first, both sides of a cut are solved before the range
+	for (int w = 1; w <= cols; w++)
+	{
+		for (int h = 1; h <= rows; h++)
+		{
+			for (int x0 = 0; x0 + w <= cols; x0++)
+			{
+				for (int y0 = 0; y0 + h <= rows; y0++)
+				{
+					int x1 = x0 + w, y1 = y0 + h;
+					int idx = state(x0, x1, y0, y1);
+
+					// a leaf: the bounds of its pixels, nothing if transparent;
+					// only single cells are scanned, a range joins the bounds of its first cell line & the rest
+					Zone& bounds = leaf_bounds[idx];
+					if (w == 1 && h == 1)
+					{
+						Zone zone = cell_zone(x0, x1, y0, y1);
+						if (m_image_info->getUsedBounds(zone, bounds))
+							bounds.pos.add(zone.pos);
+					}
+					else if (w > 1)
+					{
+						bounds = join_bounds(leaf_bounds[state(x0, x0 + 1, y0, y1)], leaf_bounds[state(x0 + 1, x1, y0, y1)]);
+					}
+					else
+					{
+						bounds = join_bounds(leaf_bounds[state(x0, x1, y0, y0 + 1)], leaf_bounds[state(x0, x1, y0 + 1, y1)]);
+					}
+					unsigned int cost = 0;
+					if (!bounds.isZero())
+						cost = bounds.size.area() + options.quad_penalty;
+					int choice = 0;
+
+					for (int x = x0 + 1; x < x1 && cost > 0; x++)
+					{
+						unsigned int cut_cost = costs[state(x0, x, y0, y1)] + costs[state(x, x1, y0, y1)];
+						if (cut_cost < cost)
+						{
+							cost = cut_cost;
+							choice = x - x0;
+						}
+					}
+					for (int y = y0 + 1; y < y1 && cost > 0; y++)
+					{
+						unsigned int cut_cost = costs[state(x0, x1, y0, y)] + costs[state(x0, x1, y, y1)];
+						if (cut_cost < cost)
+						{
+							cost = cut_cost;
+							choice = y0 - y;
+						}
+					}
+
+					costs[idx] = cost;
+					choices[idx] = choice;
+				}
+			}
+		}
+	}
+
+	if (choices[state(0, cols, 0, rows)] == 0)
+		return false;
+
+	// walk the cuts down to the leaves, in the order of the cuts
+	std::vector<Zone> zones;
+	std::vector<int> ranges;
+	int range[4] = { 0, cols, 0, rows };
+	ranges.insert(ranges.end(), range, range + 4);
+	while (!ranges.empty())
+	{
+		int y1 = ranges.back(); ranges.pop_back();
+		int y0 = ranges.back(); ranges.pop_back();
+		int x1 = ranges.back(); ranges.pop_back();
+		int x0 = ranges.back(); ranges.pop_back();
+		int idx = state(x0, x1, y0, y1);
+		if (costs[idx] == 0)
+			continue;
+
+		int choice = choices[idx];
+		if (choice == 0)
+		{
+			Zone bounds = leaf_bounds[idx];
+			bounds.pos.add(Position(-m_abs_zone.pos.x, -m_abs_zone.pos.y));
+			zones.push_back(bounds);
+			continue;
+		}
+
+		// second side pushed first, the first side pops first
+		int x = choice > 0 ? x0 + choice : x1;
+		int y = choice < 0 ? y0 - choice : y1;
+		int tail[4] = { choice > 0 ? x : x0, x1, choice < 0 ? y : y0, y1 };
+		int head[4] = { x0, x, y0, y };
+		ranges.insert(ranges.end(), tail, tail + 4);
+		ranges.insert(ranges.end(), head, head + 4);
+	}
+
+	_cropChildren(zones, false);
+	return true;
+}
+
+void ImageRect::_cropChildren(const std::vector<Zone>& zones, bool halving /*= true*/)
+{
+	if (zones.empty())
+		return;
+
+	m_children = m_image_info->getRectArena().alloc((int)zones.size());
+	m_child_num = (int)zones.size();
+	for (int i = 0; i < m_child_num; i++)
+	{
+		new (m_children + i) ImageRect(m_image_info, this, zones[i]);
+	}
+
+	if (!halving)
+		return;
+
+	// each child & its halving subtree is a task
+	TaskGroup group(getImageInfo()->getOptions().scheduler);
+	for (int i = 0; i < m_child_num; i++)
+	{
+		ImageRect* child = m_children + i;
+		group.spawn([child]()
+			{
+				child->cropHalving();
+			}
+		);
+	}
+	group.wait();
+}
+
+void ImageRect::_initCropUnusedBorder()
+{
+	assert(isLeafRect() && "Error: Must Trim a Leaf Rect!");
+
+	Zone bounds;
+	if (!m_image_info->getUsedBounds(m_abs_zone, bounds))
+	{
+		// full transparent
+		m_zone.size = Size(0, 0);
+		m_abs_zone.size = m_zone.size;
+		return;
+	}
+
+	// shrink the view to the used border, no pixel copied
+	m_zone.pos.add(bounds.pos);
+	m_zone.size = bounds.size;
+	m_abs_zone.pos.add(bounds.pos);
+	m_abs_zone.size = bounds.size;
+}
+
+void ImageRect::_getPixelCount(unsigned int& used, unsigned int& unused, unsigned int& opacity, unsigned int& total)
+{
+	// query the alpha planes of raw image, rotation does not change the counts
+	Zone abs_zone = getAbsZone();
+	m_image_info->getPixelCount(abs_zone, used, opacity);
+	total = abs_zone.size.area();
+	unused = total - used;
+	
+	assert(total == (used + unused) && "Error: total != (used + unused) !!");
+}
+
+
+//////////////////////////////////////////////////////////////////////////
+
+Compositor::Compositor()
+: m_min_rect_side(0)
+, m_free_merge_count(0)
+, m_free_merge_area(0)
+, m_open_texture(0)
+, m_pack_attempts(0)
+, m_bound_pages(0)
+, m_bound_page_area(0)
+, m_slice_chunk_idx(0)
+, m_slice_chunk_used(0)
+{
+}
+
+Compositor::~Compositor()
+{
+	_clearSlices();
+	_clearTextures();
+	_clearImages();
+
+	for (auto chunk: m_slice_chunks)
+	{
+		::operator delete(chunk);
+	}
+	m_slice_chunks.clear();
+}
+
+void Compositor::reset()
+{
+	m_rects.clear();
+	_clearSlices();
+	_clearTextures();
+	_clearImages();
+}
+
+bool Compositor::addImage(Image* image)
+{
+	assert(image && "Image Must Not NULL!");
+	if (image->getRects().empty()) // maybe not cropped yet!
+		return false;
+	if (m_image_slices.find(image) != m_image_slices.end()) // image already add to compositor 
+		return false;
+	m_image_slices.insert(ImageSlices::value_type(image, new SliceArray));
+	m_images.push_back(image);
+	m_rects.insert(m_rects.end(), image->getRects().begin(), image->getRects().end());
+
+	if (m_file_prefix.empty())
+	{
+		m_file_prefix = image->getFileName();
+		m_file_prefix = m_file_prefix.substr(0, m_file_prefix.find_last_of('.'));
+	}
+
+	return true;
+}
+
+bool Compositor::composit()
 {
 	// clear context
 	_clearSlices();
@@ -396,47 +1304,67 @@ bool Compositor::composit()
 	if (m_rects.empty())
 		return false;
 
-	// sort rects
-	std::sort(m_rects.begin(), m_rects.end(), 
-			[](ImageRect* lhs, ImageRect* rhs)
-			{
-				return lhs->getRelativeZone().size.area() > rhs->getRelativeZone().size.area();
-			}
-		);
+	// only the first of identical rects is packed, none of the single colored
+	RectArray textured_rects, rects;
+	_findColorRects(textured_rects);
+	_findDuplicates(textured_rects, rects);
 
-	// insert rects
-	for (auto it = m_rects.begin(); it != m_rects.end(); it++)
+	// fully opaque rects to pages without alpha
+	RectArray opaque_rects;
+	if (getOptions().opaque_format != kTextureFormatRGBA8888)
 	{
-		if (!_insertRect(*it))
-		{
-			// insert failed! create new texture!
-			int texture_width = _getMostSuitableWidth(it, m_rects.end());
-			texture_width = texture_width > getOptions().max_texture_size 
-				? getOptions().max_texture_size : texture_width;
-			_createTexture(texture_width);
-
-			if (!_insertRect(*it))
+		auto opaque_begin = std::stable_partition(rects.begin(), rects.end(), 
+			[](ImageRect* rect)
 			{
-				assert(false&&"Error!");
-				return false;
+				return !rect->isFullOpaque();
 			}
-		}
+		);
+		opaque_rects.assign(opaque_begin, rects.end());
+		rects.erase(opaque_begin, rects.end());
 	}
 
+	// pack with the options, or the best of many strategies
+	m_strategy = PackStrategy();
+	m_strategy.pack_mode = getOptions().pack_mode;
+	m_strategy.maxrects_heuristic = getOptions().maxrects_heuristic;
+	m_strategy.enable_rotate = getOptions().enable_rotate;
+	if (getOptions().pack_search)
+		_searchPackStrategy(rects, opaque_rects);
+	_computePackBounds(rects, opaque_rects);
+
+	// then improve the order & turns of rects in the time budget
+	std::vector<char> turns, opaque_turns;
+	bool planned = false;
+	m_pack_attempts = 0;
+	if (getOptions().pack_budget_ms > 0)
+		planned = _annealPackPlan(rects, opaque_rects, turns, opaque_turns);
+
+	if (!_packRects(rects, opaque_rects, planned ? &turns : NULL, planned ? &opaque_turns : NULL))
+		return false;
+
+	// rects are shared by search attempts, so turned only now
+	for (auto slice: m_used_slices)
+	{
+		if (slice->rotated)
+			slice->rect->rotate();
+	}
+
+	_aliasDuplicates();
+
 	// final: print to textures
 	return _printToTextures();
 }
 
 float Compositor::getUsageRatio()
 {
-	if (m_textures.empty())
+	if (m_texture_sizes.empty())
 		return 0.0f;
 
 	unsigned int slice_area_total = 0;
 	unsigned int texture_area_total = 0;
-	for (size_t i = 0; i < m_textures.size(); i++)
+	for (size_t i = 0; i < m_texture_sizes.size(); i++)
 	{
-		texture_area_total += m_textures[i]->getWidth() * m_textures[i]->getHeight();
+		texture_area_total += m_texture_sizes[i].width * m_texture_sizes[i].height;
 		for (auto slice: *m_texture_slices[i])
 		{
 			slice_area_total += slice->zone.size.area();
@@ -447,9 +1375,19 @@ float Compositor::getUsageRatio()
 	return 1.0f * slice_area_total / texture_area_total;
 }
 
+long long Compositor::getPageArea()
+{
+	long long area = 0;
+	for (auto& size: m_texture_sizes)
+	{
+		area += size.width * size.height;
+	}
+	return area;
+}
+
 float Compositor::getUsageRatioForTexture(int idx)
 {
-	if (idx >= (int)m_textures.size())
+	if (idx >= (int)m_texture_sizes.size())
 		return 0.0f;
 
 	unsigned int area_total = 0;
@@ -459,7 +1397,35 @@ float Compositor::getUsageRatioForTexture(int idx)
 		area_total += slice->zone.size.area();
 	}
 
-	return 1.0f * area_total / (m_textures[idx]->getWidth() * m_textures[idx]->getHeight());
+	return 1.0f * area_total / (m_texture_sizes[idx].width * m_texture_sizes[idx].height);
+}
+
+const char* get_texture_format_name(TextureFormat format)
+{
+	static const char* names[kTextureFormatNum] = { "RGBA8888", "RGB888", "RGB565" };
+	assert(format >= 0 && format < kTextureFormatNum && "Error: Invalid Texture Format!");
+	return names[format];
+}
+
+const char* get_pack_mode_name(PackMode mode)
+{
+	static const char* names[kPackModeNum] = { "guillotine", "maxrects", "skyline" };
+	assert(mode >= 0 && mode < kPackModeNum && "Error: Invalid Pack Mode!");
+	return names[mode];
+}
+
+const char* get_maxrects_heuristic_name(MaxRectsHeuristic heuristic)
+{
+	static const char* names[kMaxRectsHeuristicNum] = { "short_side", "area", "bottom_left", "contact" };
+	assert(heuristic >= 0 && heuristic < kMaxRectsHeuristicNum && "Error: Invalid MaxRects Heuristic!");
+	return names[heuristic];
+}
+
+const char* get_rect_sort_key_name(RectSortKey key)
+{
+	static const char* names[kRectSortKeyNum] = { "area", "max_side", "perimeter", "height" };
+	assert(key >= 0 && key < kRectSortKeyNum && "Error: Invalid Rect Sort Key!");
+	return names[key];
 }
 
 bool Compositor::saveTextures(const char* path /*= NULL*/)
@@ -478,7 +1444,17 @@ bool Compositor::saveTextures(const char* path /*= NULL*/)
 	{
 		sprintf_s(buf, 256, ICROPPER_FILE_TEXTURE_FORMAT, (fullpath+m_file_prefix).c_str(), idx, ICROPPER_DEFAULT_RAW_TEXTURE_SUFFIX);
 		CUtils::builddir(buf);
-		BOOL retv = texture->save(buf);
+		BOOL retv = FALSE;
+		if (m_texture_formats[idx] == kTextureFormatRGB888)
+		{
+			// opaque page, alpha dropped
+			fipImage rgb_texture(*texture);
+			retv = rgb_texture.convertTo24Bits() && rgb_texture.save(buf);
+		}
+		else
+		{
+			retv = texture->save(buf);
+		}
 		if (retv == FALSE)
 			return false;
 		idx++;
@@ -534,6 +1510,7 @@ bool Compositor::saveToXML(const char* path /*= NULL*/)
 		texture_element->SetAttribute("file", buf);
 		sprintf_s(buf, 256, "%d%%", int(getUsageRatioForTexture(i) * 100 + 0.5f));
 		texture_element->SetAttribute("usage", buf);
+		texture_element->SetAttribute("format", get_texture_format_name(m_texture_formats[i]));
 	}
 
 	// 3.images
@@ -542,133 +1519,757 @@ bool Compositor::saveToXML(const char* path /*= NULL*/)
 	images->SetAttribute("size", m_image_slices.size());
 	images->SetAttribute("axis_y", getOptions().flip_axis_y ? "ascent" : "descent");
 
-	for (auto image: m_image_slices)
+	for (auto image_info: m_images) // in adding order, not address order
+	{
+		SliceArray* image_slices = m_image_slices[image_info];
+		tx2::XMLElement* image_node = doc.NewElement(ICROPPER_FILE_IMAGE_NODE);
+		images->InsertEndChild(image_node);
+		image_node->SetAttribute("name", image_info->getFileName().c_str());
+		image_node->SetAttribute("width", image_info->getSize().width);
+		image_node->SetAttribute("height", image_info->getSize().height);
+		if (image_info->getOptions().is_scaled())
+			image_node->SetAttribute("scale", image_info->getOptions().scale_ratio);
+		size_t slice_size = 0;
+		for (auto slice: *image_slices)
+		{
+			tx2::XMLElement* rect_node = doc.NewElement(ICROPPER_FILE_RECT_NODE);
+			image_node->InsertEndChild(rect_node);
+
+			if (slice->has_color)
+			{
+				sprintf_s(buf, 256, "#%08X", slice->color);
+				rect_node->SetAttribute("color", buf);
+			}
+			else
+			{
+				rect_node->SetAttribute("id", slice->texture_id);
+				rect_node->SetAttribute("texture_x", slice->zone.pos.x);
+				rect_node->SetAttribute("texture_y", slice->zone.pos.y);
+			}
+			Zone abs_zone = slice->rect->getAbsZone();
+			rect_node->SetAttribute("image_x", abs_zone.pos.x);
+			if (getOptions().flip_axis_y)
+				rect_node->SetAttribute("image_y",  image_info->getSize().height - (abs_zone.pos.y + abs_zone.size.height) - 1);
+			else
+				rect_node->SetAttribute("image_y", abs_zone.pos.y);
+			rect_node->SetAttribute("width", abs_zone.size.width);
+			rect_node->SetAttribute("height", abs_zone.size.height);
+			if (slice->rect->isRotated())
+				rect_node->SetAttribute("rotate", slice->rect->isRotated());
+			if (slice->flip_x)
+				rect_node->SetAttribute("flip_x", slice->flip_x);
+			if (slice->flip_y)
+				rect_node->SetAttribute("flip_y", slice->flip_y);
+			if (slice->rect->isFullOpaque()) // drawn without blending
+				rect_node->SetAttribute("opaque", true);
+			slice_size++;
+		}
+		image_node->SetAttribute("size", slice_size);
+	}
+
+	// 4.actions
+	tx2::XMLElement* actions = doc.NewElement(ICROPPER_FILE_ACTIONS_NODE);
+	root->InsertEndChild(actions);
+
+	// save to file
+	fullpath += m_file_prefix + "." + getOptions().xml_file_suffix;
+	CUtils::builddir(fullpath.c_str());
+	return tx2::XML_SUCCESS == doc.SaveFile(fullpath.c_str());
+}
+
+bool Compositor::saveToBin(const char* path /*= NULL*/)
+{
+	CUtils::builddir(path);
+	return true;
+}
+
+void Compositor::_clearTextures()
+{
+	for (auto texture_slice: m_texture_slices)
+	{
+		delete texture_slice;
+	}
+	m_texture_slices.clear();
+	for (auto texture: m_textures)
+	{
+		delete texture;
+	}
+	m_textures.clear();
+	m_texture_formats.clear();
+	m_texture_sizes.clear();
+	for (auto bin: m_bins)
+	{
+		delete bin;
+	}
+	m_bins.clear();
+	m_open_texture = 0;
+}
+
+void Compositor::_clearImages()
+{
+	for (auto image_slice: m_image_slices)
+	{
+		delete image_slice.second;
+	}
+	m_image_slices.clear();
+	m_images.clear();
+}
+
+void Compositor::_clearSlices()
+{
+	// slices are trivially destructible, all of the pool is reused
+	m_used_slices.clear();
+	m_free_slices.clear();
+	m_alias_slices.clear();
+	m_color_slices.clear();
+	m_free_top_left.clear();
+	m_free_bottom_right.clear();
+	m_free_merge_count = 0;
+	m_free_merge_area = 0;
+	m_duplicates.clear();
+	m_spare_slices.clear();
+	m_slice_chunk_idx = 0;
+	m_slice_chunk_used = 0;
+}
+
+Size Compositor::_getMostSuitableSize(RectArray::iterator begin, RectArray::iterator end)
+{
+	int rects_area = 0;
+	int rects_side = 0; // opaque & merged rects may outsize the blocks
+	for (auto it = begin; it != end; it++)
+	{
+		Size size = (*it)->getRelativeZone().size;
+		rects_area += size.area();
+		rects_side = max(rects_side, max(size.width, size.height) + getOptions().texture_padding * 2);
+	}
+
+	Size block_size = (*begin)->getImageInfo()->getOptions().block_size;
+
+	int ewidth = (int)(sqrt(1.0f * rects_area * block_size.width / block_size.height) + 0.5f);
+	ewidth = ewidth + (ewidth / block_size.width + 1) * getOptions().texture_padding;
+	ewidth = block_size.width >= block_size.height ? ewidth : ewidth * block_size.height / block_size.width;
+	ewidth = max(max(127, ewidth), max(block_size.width, block_size.height));
+	ewidth = next_power_of_two(max(ewidth, rects_side));
+
+	float eratio = 1.0f * rects_area / (ewidth * ewidth);
+	float threshold = 0.0f;
+	if (!getOptions().force_single_texture)
+	{
+		if (ewidth > 512)
+			threshold = 0.6f;
+		else if (ewidth > 128)
+			threshold = 0.4f;
+		else
+			threshold = 0.0f;
+	}
+
+	ewidth = eratio > threshold || (ewidth >> 1) < rects_side ? ewidth : (ewidth >> 1);
+
+	// trailing pages: the height halves while rects fill no more than half of it
+	int eheight = ewidth;
+	if (!getOptions().force_single_texture)
+	{
+		while ((eheight >> 1) >= rects_side && rects_area * 2 <= ewidth * (eheight >> 1))
+		{
+			eheight >>= 1;
+		}
+	}
+
+	return Size(ewidth, eheight);
+}
+
+// pixels of a view under a RectTransform
+struct TransformedView
+{
+	TransformedView(const PixelView& _view, int _transform)
+		: view(_view)
+		, transform(_transform)
+		, size((_transform & kRectTransformTurn) ? Size(_view.size.height, _view.size.width) : _view.size)
+	{
+	}
+
+	inline const BYTE* getPixel(int x, int y) const
+	{
+		if (transform & kRectTransformFlipX)
+			x = size.width - 1 - x;
+		if (transform & kRectTransformFlipY)
+			y = size.height - 1 - y;
+		// turned counterclockwise: the right column of the view is the top line
+		if (transform & kRectTransformTurn)
+			return view.getPixel(view.size.width - 1 - y, x);
+		return view.getPixel(x, y);
+	}
+
+	const PixelView& view;
+	int transform;
+	Size size;
+};
+
+// FNV-1a of the size & pixels of a transformed view
+static unsigned long long hash_view(const TransformedView& tview)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	auto mix = [&hash](unsigned int value)
+	{
+		hash = (hash ^ value) * 1099511628211ULL;
+	};
+
+	mix(tview.size.width);
+	mix(tview.size.height);
+	int bytespp = tview.view.bytespp;
+	for (int y = 0; y < tview.size.height; y++)
+	{
+		for (int x = 0; x < tview.size.width; x++)
+		{
+			unsigned int value = 0;
+			memcpy(&value, tview.getPixel(x, y), bytespp);
+			mix(value);
+		}
+	}
+	return hash;
+}
+
+// least hash of the transforms, alike for every transformed copy of the pixels
+static unsigned long long hash_canonical(const PixelView& view, int transform_num)
+{
+	unsigned long long hash = hash_view(TransformedView(view, kRectTransformNone));
+	for (int transform = 1; transform < transform_num; transform++)
+	{
+		hash = min(hash, hash_view(TransformedView(view, transform)));
+	}
+	return hash;
+}
+
+static bool is_same_view(const PixelView& lhs, const TransformedView& rhs)
+{
+	if (lhs.size.width != rhs.size.width 
+		|| lhs.size.height != rhs.size.height 
+		|| lhs.bytespp != rhs.view.bytespp)
+		return false;
+
+	if (rhs.transform == kRectTransformNone)
+	{
+		int line_bytes = lhs.size.width * lhs.bytespp;
+		for (int y = 0; y < lhs.size.height; y++)
+		{
+			if (memcmp(lhs.getLine(y), rhs.view.getLine(y), line_bytes) != 0)
+				return false;
+		}
+		return true;
+	}
+
+	for (int y = 0; y < lhs.size.height; y++)
+	{
+		for (int x = 0; x < lhs.size.width; x++)
+		{
+			if (memcmp(lhs.getPixel(x, y), rhs.getPixel(x, y), lhs.bytespp) != 0)
+				return false;
+		}
+	}
+	return true;
+}
+
+// RRGGBBAA of a view if all pixels alike
+static bool find_single_color(const PixelView& view, unsigned int& color)
+{
+	assert(view.bytespp == 4 && "Error: Unsupported Pixel Layout!");
+	unsigned int first;
+	memcpy(&first, view.getPixel(0, 0), sizeof(first));
+	for (int y = 0; y < view.size.height; y++)
+	{
+		const BYTE* line = view.getLine(y);
+		for (int x = 0; x < view.size.width; x++, line += 4)
+		{
+			if (memcmp(line, &first, sizeof(first)) != 0)
+				return false;
+		}
+	}
+
+	const BYTE* pixel = view.getPixel(0, 0);
+	color = (pixel[FI_RGBA_RED] << 24) | (pixel[FI_RGBA_GREEN] << 16) 
+		| (pixel[FI_RGBA_BLUE] << 8) | pixel[FI_RGBA_ALPHA];
+	return true;
+}
+
+void Compositor::_findColorRects(RectArray& textured_rects)
+{
+	if (!getOptions().color_rects)
+	{
+		textured_rects = m_rects;
+		return;
+	}
+
+	for (auto rect: m_rects)
+	{
+		unsigned int color = 0;
+		if (rect->getSize().isZero() || !find_single_color(rect->getView(), color))
+		{
+			textured_rects.push_back(rect);
+			continue;
+		}
+
+		Slice* slice = _allocSlice(-1);
+		slice->rect = rect;
+		slice->has_color = true;
+		slice->color = color;
+		m_color_slices.push_back(slice);
+	}
+}
+
+void Compositor::_findDuplicates(const RectArray& rects, RectArray& unique_rects)
+{
+	m_duplicates.clear();
+	if (!getOptions().dedupe_rects)
+	{
+		unique_rects = rects;
+		return;
+	}
+
+	// turned duplicates are drawn rotated, mirrors only if rotation is off
+	int transform_num = !getOptions().dedupe_transforms ? 1 
+		: getOptions().enable_rotate ? kRectTransformNum : kRectTransformTurn;
+
+	// buckets of canonical hashes, pixels compared on collision; masters in adding order
+	std::map<unsigned long long, RectArray> buckets;
+	for (auto rect: rects)
+	{
+		if (!rect->getSize().isZero())
+		{
+			PixelView view = rect->getView();
+			RectArray& bucket = buckets[hash_canonical(view, transform_num)];
+
+			ImageRect* master = NULL;
+			int master_transform = kRectTransformNone;
+			for (size_t i = 0; i < bucket.size() && !master; i++)
+			{
+				PixelView master_view = bucket[i]->getView();
+				for (int transform = 0; transform < transform_num; transform++)
+				{
+					if (is_same_view(view, TransformedView(master_view, transform)))
+					{
+						master = bucket[i];
+						master_transform = transform;
+						break;
+					}
+				}
+			}
+
+			if (master)
+			{
+				m_duplicates.push_back(Duplicate(rect, master, master_transform));
+				continue;
+			}
+			bucket.push_back(rect);
+		}
+		unique_rects.push_back(rect);
+	}
+}
+
+void Compositor::_aliasDuplicates()
+{
+	if (m_duplicates.empty())
+		return;
+
+	std::map<ImageRect*, Slice*> rect_slices;
+	for (auto slice: m_used_slices)
+	{
+		rect_slices[slice->rect] = slice;
+	}
+
+	// a duplicate points at the texture zone of its master;
+	// turned ones take the other rotation, as a clockwise turn is a counterclockwise one mirrored both ways
+	for (auto& duplicate: m_duplicates)
+	{
+		Slice* master_slice = rect_slices[duplicate.master];
+		assert(master_slice && "Error: Master Rect Not Inserted!");
+
+		Slice* slice = _allocSlice(master_slice->texture_id);
+		slice->zone = master_slice->zone;
+		slice->rect = duplicate.rect;
+
+		bool turned = (duplicate.transform & kRectTransformTurn) != 0;
+		bool master_rotated = master_slice->rotated;
+		slice->flip_x = (duplicate.transform & kRectTransformFlipX) != 0;
+		slice->flip_y = (duplicate.transform & kRectTransformFlipY) != 0;
+		if (turned && master_rotated)
+		{
+			slice->flip_x = !slice->flip_x;
+			slice->flip_y = !slice->flip_y;
+		}
+		if (turned != master_rotated)
+			duplicate.rect->rotate();
+		m_alias_slices.push_back(slice);
+	}
+}
+
+// packing order value of a rect, the larger first
+static inline int rect_sort_value(ImageRect* rect, RectSortKey key)
+{
+	Size size = rect->getRelativeZone().size;
+	switch (key)
+	{
+	case kRectSortMaxSide:
+		return max(size.width, size.height);
+	case kRectSortPerimeter:
+		return size.width + size.height;
+	case kRectSortHeight:
+		return size.height;
+	default:
+		return size.area();
+	}
+}
+
+void Compositor::_searchPackStrategy(const RectArray& rects, const RectArray& opaque_rects)
+{
+	// every sort key, pack mode & heuristic, rotation and page size
+	std::vector<PackStrategy> strategies;
+	int page_scales[] = { 0, -1, 1 };
+	for (int sort_key = 0; sort_key < kRectSortKeyNum; sort_key++)
+	{
+		for (int mode = 0; mode < kPackModeNum; mode++)
+		{
+			int heuristic_num = mode == kPackMaxRects ? kMaxRectsHeuristicNum : 1;
+			for (int heuristic = 0; heuristic < heuristic_num; heuristic++)
+			{
+				for (int rotate = getOptions().enable_rotate ? 1 : 0; rotate >= 0; rotate--)
+				{
+					for (auto page_scale: page_scales)
+					{
+						PackStrategy strategy;
+						strategy.sort_key = (RectSortKey)sort_key;
+						strategy.pack_mode = (PackMode)mode;
+						strategy.maxrects_heuristic = (MaxRectsHeuristic)heuristic;
+						strategy.enable_rotate = rotate != 0;
+						strategy.page_scale = page_scale;
+						strategies.push_back(strategy);
+					}
+				}
+			}
+		}
+	}
+
+	// each attempt packs the rects on a compositor of its own, no pixels touched
+	std::vector<int> page_nums(strategies.size(), INT_MAX);
+	std::vector<long long> page_areas(strategies.size(), 0);
 	{
-		Image* image_info = image.first;
-		tx2::XMLElement* image_node = doc.NewElement(ICROPPER_FILE_IMAGE_NODE);
-		images->InsertEndChild(image_node);
-		image_node->SetAttribute("name", image_info->getFileName().c_str());
-		image_node->SetAttribute("width", image_info->getSize().width);
-		image_node->SetAttribute("height", image_info->getSize().height);
-		if (image_info->getOptions().is_scaled())
-			image_node->SetAttribute("scale", image_info->getOptions().scale_ratio);
-		size_t slice_size = 0;
-		for (auto slice: *image.second)
+		TaskGroup group(getOptions().scheduler);
+		for (size_t i = 0; i < strategies.size(); i++)
 		{
-			tx2::XMLElement* rect_node = doc.NewElement(ICROPPER_FILE_RECT_NODE);
-			image_node->InsertEndChild(rect_node);
-
-			rect_node->SetAttribute("id", slice->texture_id);
-			rect_node->SetAttribute("texture_x", slice->zone.pos.x);
-			rect_node->SetAttribute("texture_y", slice->zone.pos.y);
-			Zone abs_zone = slice->rect->getAbsZone();
-			rect_node->SetAttribute("image_x", abs_zone.pos.x);
-			if (getOptions().flip_axis_y)
-				rect_node->SetAttribute("image_y",  image_info->getSize().height - (abs_zone.pos.y + abs_zone.size.height) - 1);
-			else
-				rect_node->SetAttribute("image_y", abs_zone.pos.y);
-			rect_node->SetAttribute("width", abs_zone.size.width);
-			rect_node->SetAttribute("height", abs_zone.size.height);
-			if (slice->rect->isRotated())
-				rect_node->SetAttribute("rotate", slice->rect->isRotated());
-			slice_size++;
+			group.spawn([this, i, &strategies, &rects, &opaque_rects, &page_nums, &page_areas]()
+				{
+					Compositor attempt;
+					attempt.m_options = m_options;
+					attempt.m_strategy = strategies[i];
+					RectArray attempt_rects(rects), attempt_opaque_rects(opaque_rects);
+					if (!attempt._packRects(attempt_rects, attempt_opaque_rects))
+						return;
+
+					page_nums[i] = (int)attempt.m_texture_sizes.size();
+					page_areas[i] = attempt.getPageArea();
+				}
+			);
 		}
-		image_node->SetAttribute("size", slice_size);
+		group.wait();
 	}
 
-	// 4.actions
-	tx2::XMLElement* actions = doc.NewElement(ICROPPER_FILE_ACTIONS_NODE);
-	root->InsertEndChild(actions);
+	// fewest pages, then the least page area, i.e. the highest usage, of attempts taking
+	// no more page area than packing with the options, so fewer binds never cost memory;
+	// ties keep the options, then the first attempt, so the same options give the same textures
+	size_t best = strategies.size();
+	for (size_t i = 0; i < strategies.size() && best == strategies.size(); i++)
+	{
+		const PackStrategy& strategy = strategies[i];
+		if (strategy.sort_key == m_strategy.sort_key && strategy.pack_mode == m_strategy.pack_mode 
+			&& (strategy.pack_mode != kPackMaxRects || strategy.maxrects_heuristic == m_strategy.maxrects_heuristic)
+			&& strategy.enable_rotate == m_strategy.enable_rotate && strategy.page_scale == m_strategy.page_scale)
+			best = i;
+	}
+	assert(best < strategies.size() && "Error: Options Not Searched!");
+	if (page_nums[best] == INT_MAX)
+		return;
 
-	// save to file
-	fullpath += m_file_prefix + "." + getOptions().xml_file_suffix;
-	CUtils::builddir(fullpath.c_str());
-	return tx2::XML_SUCCESS == doc.SaveFile(fullpath.c_str());
+	long long area_bound = page_areas[best];
+	for (size_t i = 0; i < strategies.size(); i++)
+	{
+		if (page_areas[i] > area_bound || page_nums[i] == INT_MAX)
+			continue;
+		if (page_nums[i] < page_nums[best] || (page_nums[i] == page_nums[best] && page_areas[i] < page_areas[best]))
+			best = i;
+	}
+	m_strategy = strategies[best];
 }
 
-bool Compositor::saveToBin(const char* path /*= NULL*/)
+bool Compositor::_packRects(RectArray& rects, RectArray& opaque_rects, 
+	const std::vector<char>* turns /*= NULL*/, const std::vector<char>* opaque_turns /*= NULL*/)
 {
-	CUtils::builddir(path);
+	if (!_insertRects(rects, kTextureFormatRGBA8888, turns) 
+		|| !_insertRects(opaque_rects, getOptions().opaque_format, opaque_turns))
+		return false;
+
+	_shrinkTextures();
 	return true;
 }
 
-void Compositor::_clearTextures()
+// result of packing a plan, annealing takes the cost
+struct PackPlanResult
 {
-	for (auto texture_slice: m_texture_slices)
+	PackPlanResult() : packed(false), pages(0), page_area(0), cost(0.0) {}
+
+	// texture bytes first, then binds
+	inline bool isBetterThan(const PackPlanResult& other) const
 	{
-		delete texture_slice;
+		return packed && (!other.packed || page_area < other.page_area 
+			|| (page_area == other.page_area && pages < other.pages));
 	}
-	m_texture_slices.clear();
-	for (auto texture: m_textures)
+
+	bool packed;
+	int pages;
+	long long page_area;
+	double cost;	// page area in max pages, plus a little for the fill of the last page to drain it
+};
+
+bool Compositor::_annealPackPlan(RectArray& rects, RectArray& opaque_rects, std::vector<char>& turns, std::vector<char>& opaque_turns)
+{
+	// color rects may have taken every rect: nothing to move around
+	if (rects.empty() && opaque_rects.empty())
+		return false;
+
+	auto start = std::chrono::steady_clock::now();
+	double max_page_area = 1.0 * getOptions().max_texture_size * getOptions().max_texture_size;
+
+	// packs a plan on a compositor of its own
+	auto evaluate = [this, max_page_area](const RectArray& plan_rects, const RectArray& plan_opaque_rects, 
+		const std::vector<char>* plan_turns, const std::vector<char>* plan_opaque_turns, 
+		std::map<ImageRect*, bool>* rotations) -> PackPlanResult
 	{
-		delete texture;
+		PackPlanResult result;
+		Compositor attempt;
+		attempt.m_options = m_options;
+		attempt.m_strategy = m_strategy;
+		RectArray attempt_rects(plan_rects), attempt_opaque_rects(plan_opaque_rects);
+		result.packed = attempt._packRects(attempt_rects, attempt_opaque_rects, plan_turns, plan_opaque_turns);
+		if (!result.packed)
+			return result;
+
+		long long last_area = 0;
+		int last_page = (int)attempt.m_texture_sizes.size() - 1;
+		for (auto slice: attempt.m_used_slices)
+		{
+			if (slice->texture_id == last_page)
+				last_area += slice->zone.size.area();
+			if (rotations)
+				(*rotations)[slice->rect] = slice->rotated;
+		}
+
+		result.pages = (int)attempt.m_texture_sizes.size();
+		result.page_area = attempt.getPageArea();
+		result.cost = result.page_area / max_page_area;
+		if (last_page >= 0)
+			result.cost += 0.01 * last_area / attempt.m_texture_sizes[last_page].area();
+		return result;
+	};
+
+	// the plan starts from the strategy: sorted, turned as packed
+	RectArray original_rects(rects), original_opaque_rects(opaque_rects);
+	std::map<ImageRect*, bool> rotations;
+	PackPlanResult base = evaluate(rects, opaque_rects, NULL, NULL, &rotations);
+	m_pack_attempts = 1;
+	if (!base.packed)
+		return false;
+
+	_sortRects(rects);
+	_sortRects(opaque_rects);
+	turns.resize(rects.size());
+	opaque_turns.resize(opaque_rects.size());
+	for (size_t i = 0; i < rects.size(); i++)
+	{
+		turns[i] = rotations[rects[i]] ? 1 : 0;
+	}
+	for (size_t i = 0; i < opaque_rects.size(); i++)
+	{
+		opaque_turns[i] = rotations[opaque_rects[i]] ? 1 : 0;
 	}
-	m_textures.clear();
-}
 
-void Compositor::_clearImages()
-{
-	for (auto image_slice: m_image_slices)
+	// replaying the order & turns packs the same layout, so the plan costs as the base
+	RectArray current_rects(rects), current_opaque_rects(opaque_rects);
+	std::vector<char> current_turns(turns), current_opaque_turns(opaque_turns);
+	PackPlanResult current = base;
+	PackPlanResult best = current;
+
+	// anneal: swap, move or turn a rect, take worse plans less as it cools
+	std::mt19937 rng(ICROPPER_ANNEAL_SEED);
+	double budget = getOptions().pack_budget_ms;
+	for (;;)
 	{
-		delete image_slice.second;
+		double elapsed = (double)std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		if (elapsed >= budget)
+			break;
+		double temperature = ICROPPER_ANNEAL_START_TEMPERATURE * pow(0.001, elapsed / budget);
+
+		RectArray next_rects(current_rects), next_opaque_rects(current_opaque_rects);
+		std::vector<char> next_turns(current_turns), next_opaque_turns(current_opaque_turns);
+		// only a list with rects in it is picked
+		bool opaque = next_rects.empty()
+			|| (!next_opaque_rects.empty() && (size_t)(rng() % (next_rects.size() + next_opaque_rects.size())) >= next_rects.size());
+		RectArray& list = opaque ? next_opaque_rects : next_rects;
+		std::vector<char>& list_turns = opaque ? next_opaque_turns : next_turns;
+
+		size_t from = rng() % list.size(), to = rng() % list.size();
+		int move = rng() % 3;
+		if (move == 2 && m_strategy.enable_rotate)
+		{
+			list_turns[from] = !list_turns[from];
+		}
+		else if (move == 1 && from != to)
+		{
+			ImageRect* rect = list[from];
+			char turn = list_turns[from];
+			list.erase(list.begin() + from);
+			list_turns.erase(list_turns.begin() + from);
+			list.insert(list.begin() + to, rect);
+			list_turns.insert(list_turns.begin() + to, turn);
+		}
+		else
+		{
+			std::swap(list[from], list[to]);
+			std::swap(list_turns[from], list_turns[to]);
+		}
+
+		PackPlanResult next = evaluate(next_rects, next_opaque_rects, &next_turns, &next_opaque_turns, NULL);
+		m_pack_attempts++;
+		if (!next.packed)
+			continue;
+
+		double delta = next.cost - current.cost;
+		if (delta <= 0.0 || (rng() % 1000000) * 0.000001 < exp(-delta / temperature))
+		{
+			current = next;
+			current_rects.swap(next_rects);
+			current_opaque_rects.swap(next_opaque_rects);
+			current_turns.swap(next_turns);
+			current_opaque_turns.swap(next_opaque_turns);
+			if (current.isBetterThan(best))
+			{
+				best = current;
+				rects = current_rects;
+				opaque_rects = current_opaque_rects;
+				turns = current_turns;
+				opaque_turns = current_opaque_turns;
+			}
+		}
 	}
-	m_image_slices.clear();
+
+	// no worse than packing with the strategy, else the rects are packed as before
+	if (best.isBetterThan(base) || (!base.isBetterThan(best) && best.cost < base.cost))
+		return true;
+
+	rects.swap(original_rects);
+	opaque_rects.swap(original_opaque_rects);
+	return false;
 }
 
-void Compositor::_clearSlices()
+void Compositor::_computePackBounds(const RectArray& rects, const RectArray& opaque_rects)
 {
-	for (auto slice: m_used_slices)
-	{
-		delete slice;
-	}
-	for (auto slice: m_free_slices)
+	// runs of formats never share pages; a page of max size holds rects inside its padding
+	int padding = getOptions().texture_padding;
+	long long page_room = 1LL * (getOptions().max_texture_size - padding) * (getOptions().max_texture_size - padding);
+	const RectArray* runs[] = { &rects, &opaque_rects };
+	m_bound_pages = 0;
+	m_bound_page_area = 0;
+	for (auto run: runs)
 	{
-		delete slice;
+		long long padded_area = 0;
+		for (auto rect: *run)
+		{
+			Size size = rect->getSize();
+			padded_area += 1LL * (size.width + padding) * (size.height + padding);
+		}
+		m_bound_pages += (int)((padded_area + page_room - 1) / page_room);
+		m_bound_page_area += padded_area;
 	}
-	m_used_slices.clear();
-	m_free_slices.clear();
 }
 
-int Compositor::_getMostSuitableWidth(RectArray::iterator begin, RectArray::iterator end)
+void Compositor::_sortRects(RectArray& rects)
 {
-	int rects_area = 0;
-	for (auto it = begin; it != end; it++)
+	RectSortKey sort_key = m_strategy.sort_key;
+	std::sort(rects.begin(), rects.end(), 
+			[sort_key](ImageRect* lhs, ImageRect* rhs)
+			{
+				return rect_sort_value(lhs, sort_key) > rect_sort_value(rhs, sort_key);
+			}
+		);
+}
+
+bool Compositor::_insertRects(RectArray& rects, TextureFormat format, const std::vector<char>* turns /*= NULL*/)
+{
+	// pages of the last format are closed
+	_clearFreeSlices();
+	m_open_texture = (int)m_texture_sizes.size();
+	if (rects.empty())
+		return true;
+
+	m_min_rect_side = INT_MAX;
+	for (auto rect: rects)
 	{
-		rects_area += (*it)->getRelativeZone().size.area();
+		m_min_rect_side = min(m_min_rect_side, min(rect->getSize().width, rect->getSize().height));
 	}
+	m_min_rect_side += getOptions().texture_padding;
 
-	Size block_size = (*begin)->getImageInfo()->getOptions().block_size;
-
-	int ewidth = (int)(sqrt(1.0f * rects_area * block_size.width / block_size.height) + 0.5f);
-	ewidth = ewidth + (ewidth / block_size.width + 1) * getOptions().texture_padding;
-	ewidth = block_size.width >= block_size.height ? ewidth : ewidth * block_size.height / block_size.width;
-	ewidth = max(max(127, ewidth), max(block_size.width, block_size.height));
-	ewidth = next_power_of_two(ewidth);
+	// sort rects, a plan keeps its order
+	if (!turns)
+		_sortRects(rects);
 
-	float eratio = 1.0f * rects_area / (ewidth * ewidth);
-	float threshold = 0.0f;
-	if (!getOptions().force_single_texture)
+	// insert rects
+	for (auto it = rects.begin(); it != rects.end(); it++)
 	{
-		if (ewidth > 512)
-			threshold = 0.6f;
-		else if (ewidth > 128)
-			threshold = 0.4f;
-		else
-			threshold = 0.0f;
+		int turn = turns ? (*turns)[it - rects.begin()] : -1;
+		if (!_insertRect(*it, turn))
+		{
+			// insert failed! create new texture!
+			// skyline is the fast mode, pages are closed at the first miss
+			if (m_strategy.pack_mode == kPackSkyline)
+				m_open_texture = (int)m_texture_sizes.size();
+			Size texture_size = _getMostSuitableSize(it, rects.end());
+			if (m_strategy.page_scale > 0)
+			{
+				texture_size.width <<= m_strategy.page_scale;
+				texture_size.height <<= m_strategy.page_scale;
+			}
+			else if (m_strategy.page_scale < 0)
+			{
+				Size rect_size = (*it)->getSize();
+				int rect_side = next_power_of_two(max(rect_size.width, rect_size.height) + getOptions().texture_padding * 2 - 1);
+				texture_size.width = max(texture_size.width >> -m_strategy.page_scale, rect_side);
+				texture_size.height = max(texture_size.height >> -m_strategy.page_scale, rect_side);
+			}
+			texture_size.width = min(texture_size.width, getOptions().max_texture_size);
+			texture_size.height = min(texture_size.height, getOptions().max_texture_size);
+			_createTexture(texture_size, format);
+
+			if (!_insertRect(*it, turn))
+			{
+				assert(false&&"Error!");
+				return false;
+			}
+		}
 	}
 
-	ewidth = eratio > threshold ? ewidth : (ewidth >> 1);
-	return ewidth;
+	return true;
 }
 
-bool Compositor::_insertRect(ImageRect* rect)
+bool Compositor::_insertRect(ImageRect* rect, int turn /*= -1*/)
 {
+	if (m_strategy.pack_mode != kPackGuillotine)
+		return _insertRectToBin(rect, turn);
+
 	Size rect_size = rect->getSize();
 	Size rect_size_rotate(rect_size.height, rect_size.width);
-	Slice* slice = _findFreeSlice(rect_size);
+	bool rotated = false;
+	Slice* slice = turn != 1 ? _findFreeSlice(rect_size) : NULL;
 	if (!slice)
 	{
-		if (getOptions().enable_rotate)
+		if (turn != 0 && (turn == 1 || m_strategy.enable_rotate))
 			slice = _findFreeSlice(rect_size_rotate);
 		if (!slice)
 		{
@@ -676,78 +2277,196 @@ bool Compositor::_insertRect(ImageRect* rect)
 		}
 		else
 		{
-			rect->rotate();
+			rotated = true;
 		}
 	}
 
 	slice->rect = rect;
+	slice->rotated = rotated;
 	m_used_slices.push_back(slice);
 
 	return true;
 }
 
-void Compositor::_createTexture(int texture_width)
+void Compositor::_createTexture(Size texture_size, TextureFormat format)
 {
-	int texture_id = m_textures.size();
+	int texture_id = m_texture_sizes.size();
 
-	Slice* slice = new Slice(texture_id);
-	slice->zone.pos = Position(getOptions().texture_padding, getOptions().texture_padding);
-	slice->zone.size = Size(
-		texture_width - getOptions().texture_padding*2, 
-		texture_width - getOptions().texture_padding*2);
-	m_free_slices.push_back(slice);
+	int padding = getOptions().texture_padding;
+	if (m_strategy.pack_mode == kPackGuillotine)
+	{
+		// free slices hold the padding on right & bottom of rects, as bins do
+		Slice* slice = _allocSlice(texture_id);
+		slice->zone.pos = Position(padding, padding);
+		slice->zone.size = Size(
+			texture_size.width - padding, 
+			texture_size.height - padding);
+		_addFreeSlice(slice);
+	}
+	else
+	{
+		// rects take the padding on right & bottom in bins
+		Zone bounds(Position(padding, padding), Size(texture_size.width - padding, texture_size.height - padding));
+		if (m_strategy.pack_mode == kPackSkyline)
+			m_bins.push_back(new SkylineBin(bounds, padding));
+		else
+			m_bins.push_back(new MaxRectsBin(bounds, padding, m_strategy.maxrects_heuristic));
+		assert((int)m_bins.size() == texture_id + 1 && "Error: Bins Out of Pages!");
+	}
 
-	fipImage* image = new fipImage(FIT_BITMAP, texture_width, texture_width, 32);
-	m_textures.push_back(image);
+	m_texture_sizes.push_back(texture_size);
+	m_texture_formats.push_back(format);
 	m_texture_slices.push_back(new SliceArray);
-	assert( m_textures.size() == m_texture_slices.size());
+	assert( m_texture_sizes.size() == m_texture_slices.size());
+}
+
+void Compositor::_shrinkTextures()
+{
+	int padding = getOptions().texture_padding;
+	std::vector<SliceArray> page_slices(m_texture_sizes.size());
+	for (auto slice: m_used_slices)
+	{
+		page_slices[slice->texture_id].push_back(slice);
+	}
+
+	for (size_t i = 0; i < m_texture_sizes.size(); i++)
+	{
+		Size& texture_size = m_texture_sizes[i];
+		SliceArray& slices = page_slices[i];
+
+		// rects are placed from the left top, so first cut to the pot rect holding them
+		Size extent(0, 0);
+		long long padded_area = 0;
+		for (auto slice: slices)
+		{
+			extent.width = max(extent.width, slice->zone.pos.x + slice->zone.size.width + padding);
+			extent.height = max(extent.height, slice->zone.pos.y + slice->zone.size.height + padding);
+			padded_area += 1LL * (slice->zone.size.width + padding) * (slice->zone.size.height + padding);
+		}
+		texture_size.width = min(texture_size.width, (int)next_power_of_two(extent.width - 1));
+		texture_size.height = min(texture_size.height, (int)next_power_of_two(extent.height - 1));
+
+		// then repack the page alone into smaller pot rects with room for the rects, the least area first;
+		// the page's own packer takes the rects in their order and turns
+		std::vector<Size> candidates;
+		for (int width = 1; width <= texture_size.width; width <<= 1)
+		{
+			for (int height = 1; height <= texture_size.height; height <<= 1)
+			{
+				if (width <= padding || height <= padding || width * height >= texture_size.width * texture_size.height)
+					continue;
+				if (1LL * (width - padding) * (height - padding) >= padded_area)
+					candidates.push_back(Size(width, height));
+			}
+		}
+		std::stable_sort(candidates.begin(), candidates.end(), 
+			[](const Size& lhs, const Size& rhs)
+			{
+				return lhs.width * lhs.height < rhs.width * rhs.height;
+			}
+		);
+
+		int min_rect_side = INT_MAX;
+		for (auto slice: slices)
+		{
+			min_rect_side = min(min_rect_side, min(slice->zone.size.width, slice->zone.size.height));
+		}
+
+		for (auto& candidate: candidates)
+		{
+			Compositor attempt;
+			attempt.m_options = m_options;
+			attempt.m_strategy = m_strategy;
+			attempt.m_min_rect_side = min_rect_side + padding;
+			attempt._createTexture(candidate, m_texture_formats[i]);
+			bool fits = true;
+			for (size_t j = 0; j < slices.size() && fits; j++)
+			{
+				fits = attempt._insertRect(slices[j]->rect, slices[j]->rotated ? 1 : 0);
+			}
+			if (!fits)
+				continue;
+
+			for (size_t j = 0; j < slices.size(); j++)
+			{
+				slices[j]->zone = attempt.m_used_slices[j]->zone;
+			}
+			texture_size = candidate;
+			break;
+		}
+	}
+}
+
+bool Compositor::_insertRectToBin(ImageRect* rect, int turn)
+{
+	Size rect_size = rect->getSize();
+	if (turn == 1)
+		rect_size = Size(rect_size.height, rect_size.width);
+
+	for (int i = m_open_texture; i < (int)m_bins.size(); i++)
+	{
+		Zone zone;
+		bool rotated = false;
+		if (!m_bins[i]->insert(rect_size, turn < 0 && m_strategy.enable_rotate, zone, rotated))
+			continue;
+		if (turn == 1)
+			rotated = true;
+
+		Slice* slice = _allocSlice(i);
+		slice->zone = zone;
+		slice->rect = rect;
+		slice->rotated = rotated;
+		m_used_slices.push_back(slice);
+		return true;
+	}
+
+	return false;
 }
 
 Compositor::Slice* Compositor::_findFreeSlice(Size rect_size)
 {
+	Size padded(rect_size.width + getOptions().texture_padding, rect_size.height + getOptions().texture_padding);
+
+	// slices taking the rect are no narrower than its short side
 	Slice* slice = NULL;
-	for (auto it = m_free_slices.begin(); it != m_free_slices.end(); it++)
+	for (auto it = m_free_slices.lower_bound(min(padded.width, padded.height)); it != m_free_slices.end(); it++)
 	{
-		if ((*it)->zone.contains(rect_size))
+		if (it->second->zone.contains(padded))
 		{
-			slice = *it;
-			m_free_slices.erase(it);
+			slice = it->second;
+			_removeFreeSlice(it);
 			break;
 		}
 	}
 
 	if (slice)
 	{
-		int right = slice->zone.pos.x + rect_size.width;
-		int bottom = slice->zone.pos.y + rect_size.height;
+		int right = slice->zone.pos.x + padded.width;
+		int bottom = slice->zone.pos.y + padded.height;
 		int bottom_width = slice->zone.size.width;
 		int right_height = slice->zone.size.height;
-		if (rect_size.width >= rect_size.height)
+		if (padded.width >= padded.height)
 		{
-			bottom_width = rect_size.width;
+			bottom_width = padded.width;
 		}
 		else
 		{
-			right_height = rect_size.height;
+			right_height = padded.height;
 		}
 		
-		Slice* bottom_slice = new Slice(slice->texture_id);
-		bottom_slice->zone.pos = Position(slice->zone.pos.x, bottom + getOptions().texture_padding);
+		Slice* bottom_slice = _allocSlice(slice->texture_id);
+		bottom_slice->zone.pos = Position(slice->zone.pos.x, bottom);
 		bottom_slice->zone.size = Size(
 			bottom_width, 
-			slice->zone.size.height - rect_size.height - getOptions().texture_padding);
-
-		if (bottom_slice->zone.size.height > getOptions().texture_padding)
-			m_free_slices.push_back(bottom_slice);
+			slice->zone.size.height - padded.height);
+		_addFreeSlice(bottom_slice);
 
-		Slice* right_slice = new Slice(slice->texture_id);
-		right_slice->zone.pos = Position(right + getOptions().texture_padding, slice->zone.pos.y);
+		Slice* right_slice = _allocSlice(slice->texture_id);
+		right_slice->zone.pos = Position(right, slice->zone.pos.y);
 		right_slice->zone.size = Size(
-			slice->zone.size.width - rect_size.width - getOptions().texture_padding, 
+			slice->zone.size.width - padded.width, 
 			right_height);
-
-		if (bottom_slice->zone.size.width > getOptions().texture_padding)
-			m_free_slices.push_back(right_slice);
+		_addFreeSlice(right_slice);
 
 		slice->zone.size = rect_size;
 	}
@@ -755,16 +2474,160 @@ Compositor::Slice* Compositor::_findFreeSlice(Size rect_size)
 	return slice;
 }
 
+// corners of free slices never coincide on a page
+static inline unsigned long long corner_key(int texture_id, int x, int y)
+{
+	return ((unsigned long long)texture_id << 40) | ((unsigned long long)x << 20) | (unsigned long long)y;
+}
+
+void Compositor::_addFreeSlice(Slice* slice)
+{
+	Zone& zone = slice->zone;
+	if (zone.size.width <= 0 || zone.size.height <= 0)
+	{
+		_freeSlice(slice);
+		return;
+	}
+
+	// a joined slice may line up with another
+	while (_mergeFreeSlice(slice))
+	{
+	}
+
+	int short_side = min(zone.size.width, zone.size.height);
+	if (short_side < m_min_rect_side)
+	{
+		_freeSlice(slice);
+		return;
+	}
+
+	auto it = m_free_slices.insert(FreeSliceIndex::value_type(short_side, slice));
+	m_free_top_left[corner_key(slice->texture_id, zone.pos.x, zone.pos.y)] = it;
+	m_free_bottom_right[corner_key(slice->texture_id, 
+		zone.pos.x + zone.size.width, zone.pos.y + zone.size.height)] = it;
+}
+
+void Compositor::_removeFreeSlice(FreeSliceIndex::iterator it)
+{
+	// erased by the entry, many slices may share a short side
+	Slice* slice = it->second;
+	Zone& zone = slice->zone;
+	m_free_slices.erase(it);
+	m_free_top_left.erase(corner_key(slice->texture_id, zone.pos.x, zone.pos.y));
+	m_free_bottom_right.erase(corner_key(slice->texture_id, 
+		zone.pos.x + zone.size.width, zone.pos.y + zone.size.height));
+}
+
+bool Compositor::_mergeFreeSlice(Slice* slice)
+{
+	// a free slice sharing a whole edge, rects keep their padding in free slices
+	// so lined up slices join without a gap
+	Zone& zone = slice->zone;
+	int right = zone.pos.x + zone.size.width;
+	int bottom = zone.pos.y + zone.size.height;
+
+	Slice* partner = NULL;
+	auto it = m_free_top_left.find(corner_key(slice->texture_id, zone.pos.x, bottom));
+	if (it != m_free_top_left.end() && it->second->second->zone.size.width == zone.size.width)
+	{
+		// below
+		partner = it->second->second;
+		zone.size.height += partner->zone.size.height;
+	}
+	else if ((it = m_free_top_left.find(corner_key(slice->texture_id, right, zone.pos.y))) != m_free_top_left.end()
+		&& it->second->second->zone.size.height == zone.size.height)
+	{
+		// right
+		partner = it->second->second;
+		zone.size.width += partner->zone.size.width;
+	}
+	else if ((it = m_free_bottom_right.find(corner_key(slice->texture_id, right, zone.pos.y))) != m_free_bottom_right.end()
+		&& it->second->second->zone.size.width == zone.size.width)
+	{
+		// above
+		partner = it->second->second;
+		zone.pos.y = partner->zone.pos.y;
+		zone.size.height += partner->zone.size.height;
+	}
+	else if ((it = m_free_bottom_right.find(corner_key(slice->texture_id, zone.pos.x, bottom))) != m_free_bottom_right.end()
+		&& it->second->second->zone.size.height == zone.size.height)
+	{
+		// left
+		partner = it->second->second;
+		zone.pos.x = partner->zone.pos.x;
+		zone.size.width += partner->zone.size.width;
+	}
+
+	if (!partner)
+		return false;
+
+	m_free_merge_count++;
+	m_free_merge_area += partner->zone.size.width * partner->zone.size.height;
+	_removeFreeSlice(it->second);
+	_freeSlice(partner);
+	return true;
+}
+
+void Compositor::_clearFreeSlices()
+{
+	for (auto& free_slice: m_free_slices)
+	{
+		_freeSlice(free_slice.second);
+	}
+	m_free_slices.clear();
+	m_free_top_left.clear();
+	m_free_bottom_right.clear();
+}
+
+Compositor::Slice* Compositor::_allocSlice(int texture_id)
+{
+	Slice* slice = NULL;
+	if (!m_spare_slices.empty())
+	{
+		slice = m_spare_slices.back();
+		m_spare_slices.pop_back();
+	}
+	else
+	{
+		if (m_slice_chunk_idx < m_slice_chunks.size() && m_slice_chunk_used == ICROPPER_SLICE_POOL_CHUNK)
+		{
+			m_slice_chunk_idx++;
+			m_slice_chunk_used = 0;
+		}
+		if (m_slice_chunk_idx == m_slice_chunks.size())
+		{
+			m_slice_chunks.push_back(static_cast<Slice*>(::operator new(ICROPPER_SLICE_POOL_CHUNK * sizeof(Slice))));
+		}
+		slice = m_slice_chunks[m_slice_chunk_idx] + m_slice_chunk_used++;
+	}
+
+	return new (slice) Slice(texture_id);
+}
+
+void Compositor::_freeSlice(Slice* slice)
+{
+	m_spare_slices.push_back(slice);
+}
+
 bool Compositor::_printToTextures()
 {
+	for (auto& size: m_texture_sizes)
+	{
+		m_textures.push_back(new fipImage(FIT_BITMAP, size.width, size.height, 32));
+	}
+
 	for (auto slice: m_used_slices)
 	{
 		assert(slice->texture_id < (int)m_textures.size() && "Error: Invalid Texture ID!");
 		fipImage* texture = m_textures[slice->texture_id];
-		fipImage* rect = slice->rect->getImage();
-		assert(rect && "Error: Invalid Slice Rect!");
+		fipImage rect;
+		if (!slice->rect->copyToImage(rect))
+		{
+			assert(0 && "Error: Copy Slice Rect Failed!");
+			return false;
+		}
 
-		BOOL retv = texture->pasteSubImage(*rect, slice->zone.pos.x, slice->zone.pos.y);
+		BOOL retv = texture->pasteSubImage(rect, slice->zone.pos.x, slice->zone.pos.y);
 		if (retv == FALSE)
 		{
 			assert(0 && "Error: Paste Sub Image Failed!");
@@ -780,6 +2643,17 @@ bool Compositor::_printToTextures()
 		m_image_slices[slice->rect->getImageInfo()]->push_back(slice); // add to image-slice map
 	}
 
+	// duplicates & color quads are listed by their images only, the pixels are printed once or never
+	SliceArray* unprinted[] = { &m_alias_slices, &m_color_slices };
+	for (auto slices: unprinted)
+	{
+		for (auto slice: *slices)
+		{
+			assert(m_image_slices.find(slice->rect->getImageInfo()) != m_image_slices.end() && "Error: Invalid Image Name!");
+			m_image_slices[slice->rect->getImageInfo()]->push_back(slice);
+		}
+	}
+
 	// sort texture-slice map
 	for (auto slices: m_texture_slices)
 	{
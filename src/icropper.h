@@ -9,9 +9,9 @@
 //
 
 #include <string>
-#include <list>
 #include <vector>
 #include <map>
+#include <mutex>
 
 #include <FreeImage/FreeImagePlus.h>
 
@@ -21,6 +21,9 @@
 #define ICROPPER_DEFAULT_THRESHOLD_DEPTH	4
 #define ICROPPER_DEFAULT_THRESHOLD_USAGE	0.6f
 #define ICROPPER_DEFAULT_ROTATE_DEGREES		-90.0f
+#define ICROPPER_DEFAULT_CROP_CELL_SIZE		8
+#define ICROPPER_DEFAULT_CROP_QUAD_PENALTY	256
+#define ICROPPER_DEFAULT_MERGE_MAX_SIZE		256
 
 #define ICROPPER_DEFAULT_MAX_TEXTURE_SIZE	2048
 #define ICROPPER_DEFAULT_TEXTURE_PADDING	1
@@ -84,6 +87,9 @@ struct Size
 
 struct Zone
 {
+	Zone() {}
+	Zone(Position _pos, Size _size) : pos(_pos), size(_size) {}
+
 	Position pos;
 	Size size;
 
@@ -91,6 +97,35 @@ struct Zone
 	inline bool contains(Size rect_size) { return size.width >= rect_size.width && size.height >= rect_size.height; }
 };
 
+// reps a window on the pixels of a bitmap, pixels are not owned
+struct PixelView
+{
+	PixelView() : bits(NULL), pitch(0), bytespp(0) {}
+
+	// y is top-down
+	inline BYTE* getLine(int y) const { return bits + y * pitch; }
+	inline BYTE* getPixel(int x, int y) const { return getLine(y) + x * bytespp; }
+
+	BYTE* bits;		// left-top pixel
+	int pitch;		// bytes between lines, negative since FreeImage stores lines bottom-up
+	int bytespp;
+	Size size;
+};
+
+// 64 pixels of a 1 bit alpha plane, pixel x at bit x % 64
+typedef unsigned long long AlphaWord;
+
+class TaskScheduler;
+class PackBin;
+
+// how cropHalving splits a rect
+enum CropSplitMode
+{
+	kCropSplitQuarter = 0,	// 4 equal quarters
+	kCropSplitGuillotine,	// 1 cut along rows or columns, where the bounds of the 2 sides are smallest
+	kCropSplitOptimal,		// least area + quad penalty over all guillotine partitions of a cell grid
+};
+
 struct CropOptions
 {
 	CropOptions()
@@ -100,6 +135,16 @@ struct CropOptions
 		, crop_usage_ratio(ICROPPER_DEFAULT_THRESHOLD_USAGE)
 		, rotate_degress(ICROPPER_DEFAULT_ROTATE_DEGREES)
 		, scale_ratio(1.0f)
+		, trim_leaves(false)
+		, split_mode(kCropSplitQuarter)
+		, cell_size(ICROPPER_DEFAULT_CROP_CELL_SIZE)
+		, quad_penalty(ICROPPER_DEFAULT_CROP_QUAD_PENALTY)
+		, merge_growth(0.0f)
+		, merge_max_size(ICROPPER_DEFAULT_MERGE_MAX_SIZE)
+		, alpha_threshold(0)
+		, alpha_clear(false)
+		, max_rect_size(ICROPPER_DEFAULT_MAX_TEXTURE_SIZE - ICROPPER_DEFAULT_TEXTURE_PADDING * 2)
+		, scheduler(NULL)
 	{
 	}
 
@@ -111,8 +156,81 @@ struct CropOptions
 	float	crop_usage_ratio;
 	float	rotate_degress;
 	float	scale_ratio;
+	bool	trim_leaves;		// shrink leaf rects to their non-transparent bounds
+	CropSplitMode split_mode;
+	int		cell_size;			// optimal split: grid cell in pixels, enlarged for big blocks
+	unsigned int quad_penalty;	// optimal split: cost of a quad in pixels of area
+	float	merge_growth;		// merge neighbor leaves if area grows less than the ratio, 0 reps no merging
+	int		merge_max_size;		// maximum width & height of a merged rect
+	int		alpha_threshold;	// pixels alpha <= threshold are transparent, 0 ~ 254
+	bool	alpha_clear;		// zero out pixels under the threshold, so kept rects hold no faint pixels
+	int		max_rect_size;		// opaque images are cut in a grid of rects no bigger, to fit in a texture
+	TaskScheduler* scheduler;	// crop in parallel if set, not owned
+};
+
+
+// pixel formats of texture pages
+enum TextureFormat
+{
+	kTextureFormatRGBA8888 = 0,
+	kTextureFormatRGB888,		// saved without alpha
+	kTextureFormatRGB565,		// saved with opaque alpha, uploaded as 16 bits by the runtime
+	kTextureFormatNum
+};
+
+const char* get_texture_format_name(TextureFormat format); // as in the manifest
+
+// how free space of pages is tracked & searched
+enum PackMode
+{
+	kPackGuillotine = 0,	// first fit free slice, split in two
+	kPackMaxRects,			// best fit of all maximal free rects
+	kPackSkyline,			// lowest fit on the outline of placed rects, fast for huge rect counts
+	kPackModeNum
+};
+
+// choice of free rect for MaxRects
+enum MaxRectsHeuristic
+{
+	kMaxRectsBestShortSideFit = 0,	// least leftover on the shorter side
+	kMaxRectsBestAreaFit,			// least leftover area
+	kMaxRectsBottomLeft,			// top most, then left most position
+	kMaxRectsContactPoint,			// most edge length touching page borders & other rects
+	kMaxRectsHeuristicNum
+};
+
+// order rects are packed in, the larger first
+enum RectSortKey
+{
+	kRectSortArea = 0,
+	kRectSortMaxSide,
+	kRectSortPerimeter,
+	kRectSortHeight,
+	kRectSortKeyNum
 };
 
+const char* get_pack_mode_name(PackMode mode);
+const char* get_maxrects_heuristic_name(MaxRectsHeuristic heuristic);
+const char* get_rect_sort_key_name(RectSortKey key);
+
+// a way of packing rects, pack search tries many & keeps the best
+struct PackStrategy
+{
+	PackStrategy()
+		: sort_key(kRectSortArea)
+		, pack_mode(kPackMaxRects)
+		, maxrects_heuristic(kMaxRectsBestShortSideFit)
+		, enable_rotate(true)
+		, page_scale(0)
+	{
+	}
+
+	RectSortKey sort_key;
+	PackMode pack_mode;
+	MaxRectsHeuristic maxrects_heuristic;
+	bool enable_rotate;
+	int page_scale;		// new pages are 2^page_scale times the most suitable width, still taking the rect
+};
 
 struct CompositorOptions
 {
@@ -126,7 +244,15 @@ struct CompositorOptions
 		, flip_axis_y(true)
 		, enable_rotate(true)
 		, fixed_texture_size(0)
-		
+		, dedupe_rects(true)
+		, dedupe_transforms(false)
+		, color_rects(false)
+		, opaque_format(kTextureFormatRGBA8888)
+		, pack_mode(kPackMaxRects)
+		, maxrects_heuristic(kMaxRectsBestShortSideFit)
+		, pack_search(false)
+		, pack_budget_ms(0)
+		, scheduler(NULL)
 	{
 	}
 	
@@ -139,10 +265,50 @@ struct CompositorOptions
 	bool flip_axis_y;
 	bool enable_rotate;
 	int fixed_texture_size;				// if use fixed texture size. 0 reps invalid.
+	bool dedupe_rects;					// rects of identical pixels share one slice
+	bool dedupe_transforms;				// also rects mirrored or turned, drawn with flipped uvs
+	bool color_rects;					// rects of a single color are drawn as color quads, out of textures
+	TextureFormat opaque_format;		// pages of fully opaque rects, RGBA8888 reps no separate pages
+	PackMode pack_mode;
+	MaxRectsHeuristic maxrects_heuristic;
+	bool pack_search;					// try strategies of all sort keys, pack modes, rotations & page sizes, keep the best
+	int pack_budget_ms;					// reorder & turn rects by annealing for the time, 0 reps off
+	TaskScheduler* scheduler;			// pack search in parallel if set, not owned
 };
 
 
-typedef std::list<class ImageRect*> RectList;
+class ImageRect;
+struct RectSpan;
+typedef std::vector<ImageRect*> RectList;
+
+//
+// Rect Arena
+//
+// rects are allocated in chunks and never move until cleared, so
+// children of a rect can be allocated as one contiguous run
+//
+class RectArena
+{
+public:
+	RectArena();
+	~RectArena();
+
+	ImageRect* alloc(int num); // contiguous storage for num rects, not constructed; thread safe
+	void clear();
+	inline size_t getRectCount() const { return m_rect_count; }
+
+private:
+	struct Chunk
+	{
+		ImageRect* rects;
+		int capacity;
+		int used;
+	};
+
+	std::vector<Chunk> m_chunks;
+	std::mutex m_lock;
+	size_t m_rect_count;
+};
 
 //
 // Raw Image
@@ -157,19 +323,48 @@ public:
 	inline const std::string& getFileName() const { return m_filename; }
 	inline const Size& getSize() const { return m_raw_size; }
 	inline fipImage* getRawImage() { return m_raw_image; }
-	inline class ImageRect* getRootRect() { return m_root_rect; }
+	inline ImageRect* getRootRect() { return m_root_rect; }
+	inline RectArena& getRectArena() { return m_arena; }
+	inline bool isOpaque() const { return m_is_opaque; } // no transparent pixel, cropped without analysis
 
 	bool crop();
 	inline RectList& getRects() { return m_rects; }
+	inline int getCroppedRectCount() const { return m_cropped_rect_count; } // leaves before merging
 	inline CropOptions& getOptions() { return m_options; }
 
+	// alpha occupancy queries on absolute zone, valid after crop
+	void getPixelCount(const Zone& zone, unsigned int& used, unsigned int& opacity);
+	inline unsigned int getUsedPixelCount(const Zone& zone) { unsigned int used, opacity; getPixelCount(zone, used, opacity); return used; }
+	bool getUsedBounds(const Zone& zone, Zone& bounds); // bounds relative to zone, false reps full transparent
+	// first & last used pixel of each row & column relative to zone, -1 reps transparent
+	void getUsedProjections(const Zone& zone, std::vector<int>& row_first, std::vector<int>& row_last, 
+		std::vector<int>& col_first, std::vector<int>& col_last);
+	PixelView getView(const Zone& zone);
+
 private:
+	bool _scanOpaque();
+	void _buildAlphaPlanes();
+	void _buildAlphaLines(int begin, int end, const unsigned int* zero_line);
+	void _mergeRects();
+
 	std::string m_filename;
 	fipImage* m_raw_image;
 	Size m_raw_size;
-	class ImageRect* m_root_rect;
-	RectList m_rects;
+	ImageRect* m_root_rect;
+	RectArena m_arena;		// owns all rects of the crop tree
+	RectList m_rects;		// leaves of the tree, merged ones are out of the tree & parented by the root
+	int m_cropped_rect_count;
+	bool m_is_opaque;
 	CropOptions m_options;
+
+	// 1 bit alpha planes, lines are top-down & padded to words
+	int m_plane_pitch;							// words per line
+	std::vector<AlphaWord> m_used_plane;		// pixels alpha > 0
+	std::vector<AlphaWord> m_opacity_plane;		// pixels alpha == 255
+
+	// summed-area tables of the planes in whole words, (pitch+1) x (height+1)
+	std::vector<unsigned int> m_used_table;
+	std::vector<unsigned int> m_opacity_table;
 };
 
 //
@@ -178,52 +373,88 @@ private:
 class ImageRect
 {
 public:
-	ImageRect(fipImage* image, Image* image_info, ImageRect* parent, Position rel_pos = Position(0, 0));
-	~ImageRect();
+	ImageRect(Image* image_info, ImageRect* parent, Zone rel_zone);
 
 	// image info
 	inline Image* getImageInfo() { return m_image_info; }
-	inline fipImage* getImage() { return m_image; }
+	PixelView getView(); // pixels on raw image, not rotated
+	bool copyToImage(fipImage& image); // copy pixels out, rotated if needed
 	float getSolidPixelsRatio(); // 0.0f ~ 1.0f; pixels not-transparent / total
 	float getOpacityPixelsRatio();
 	float getSavedAreaRatio(); // 0.0f ~ 1.0f; area saved ratio
 	bool isFullTransparent();
+	bool isFullOpaque();
 	void rotate();
 	inline bool isRotated() { return m_is_rotated; }
 
 	// tree info
 	inline ImageRect* getParent() { return m_parent; }
-	inline RectList* getChildren() { return &m_children; }
-	int getDepth();
+	inline RectSpan getChildren();
+	inline int getDepth() { return m_depth; }
 	inline bool isRootRect() { return m_parent == NULL; }
-	inline bool isLeafRect() { return m_children.empty(); }
+	inline bool isLeafRect() { return m_child_num == 0; }
 	void getLeafRects(RectList& rects);
 
 	// zone info
 	inline Zone getRelativeZone() { return m_zone; }
 	inline Size getSize() { return m_zone.size; }
-	Zone getAbsZone();
+	inline Zone getAbsZone() { return m_abs_zone; }
 
 	// crop utils
 	void cropWithFixedSize(Size block_size);
 	void cropHalving();
 
 private:
+	bool _cropGuillotine(); // false if no cut saves area
+	bool _cropOptimal(); // false if a single rect is the best
+	void _cropChildren(const std::vector<Zone>& zones, bool halving = true);
 	void _initCropUnusedBorder();
 	void _getPixelCount(unsigned int& used, unsigned int& unused, unsigned int& opacity, unsigned int& total);
 
 private:
-	fipImage* m_image;
 	Zone m_zone;
+	Zone m_abs_zone;	// cached, the tree never moves
+	int m_depth;
 	bool m_is_rotated;	// rotate 90 degrees
 	Image* m_image_info;
 
 	ImageRect* m_parent;
-	RectList m_children;
+	ImageRect* m_children;	// contiguous in the arena
+	int m_child_num;
 };
 
+// reps contiguous rects in the arena
+struct RectSpan
+{
+	RectSpan(ImageRect* _first, int _num) : first(_first), num(_num) {}
+
+	inline ImageRect* begin() const { return first; }
+	inline ImageRect* end() const { return first + num; }
+	inline int size() const { return num; }
+	inline bool empty() const { return num == 0; }
+	inline ImageRect& operator[](int idx) const { return first[idx]; }
+
+	ImageRect* first;
+	int num;
+};
+
+inline RectSpan ImageRect::getChildren()
+{
+	return RectSpan(m_children, m_child_num);
+}
+
 typedef std::vector<fipImage*> TextureArray;
 
+// dihedral transforms of rect pixels: turned 90 degrees counterclockwise first, then mirrored
+enum RectTransform
+{
+	kRectTransformNone	= 0,
+	kRectTransformFlipX	= 1,
+	kRectTransformFlipY	= 2,
+	kRectTransformTurn	= 4,
+	kRectTransformNum	= 8
+};
+
 //
 // Rect Compositor
 //
@@ -232,15 +463,33 @@ class Compositor
 public:
 	struct Slice
 	{
-		Slice(int tid) : texture_id(tid), rect(NULL) {}
+		Slice(int tid) : texture_id(tid), rect(NULL), rotated(false), flip_x(false), flip_y(false), has_color(false), color(0) {}
 
 		const int texture_id;
 		Zone zone;
 		ImageRect* rect;
+		bool rotated;	// rect placed turned, applied to the rect once packing is final
+		bool flip_x;	// rect pixels mirrored after unrotating, for duplicates
+		bool flip_y;
+		bool has_color;	// a color quad, no texture zone
+		unsigned int color;	// RRGGBBAA
+	};
+
+	// a rect sharing the slice of its master
+	struct Duplicate
+	{
+		Duplicate(ImageRect* _rect, ImageRect* _master, int _transform) 
+			: rect(_rect), master(_master), transform(_transform) {}
+
+		ImageRect* rect;
+		ImageRect* master;
+		int transform;	// rect pixels from the master's, see RectTransform
 	};
 
 	typedef std::vector<ImageRect*> RectArray;
 	typedef std::vector<Slice*> SliceArray;
+	typedef std::multimap<int, Slice*> FreeSliceIndex; // keyed by short side
+	typedef std::map<unsigned long long, FreeSliceIndex::iterator> CornerSliceIndex; // keyed by page & a corner, to the entry by short side
 	typedef std::vector<SliceArray*> TextureSlices;
 	typedef std::map<Image*, SliceArray*> ImageSlices;
 
@@ -252,11 +501,22 @@ public:
 	bool composit();
 
 	inline TextureArray& getTextures() { return m_textures; }
+	inline TextureFormat getTextureFormat(int idx) { return m_texture_formats[idx]; }
 	inline TextureSlices& getTextureSlices() { return m_texture_slices; }
 	float getUsageRatio();
 	float getUsageRatioForTexture(int idx);
+	inline int getDuplicateCount() const { return (int)m_duplicates.size(); } // rects sharing a slice of another
+	inline int getColorRectCount() const { return (int)m_color_slices.size(); }
+	inline int getFreeMergeCount() const { return m_free_merge_count; } // joins of guillotine free slices
+	inline long long getFreeMergeArea() const { return m_free_merge_area; } // free area joined into larger slices
 
 	inline CompositorOptions& getOptions() { return m_options; }
+	inline const PackStrategy& getPackStrategy() const { return m_strategy; } // of the last composit
+	inline int getPackAttemptCount() const { return m_pack_attempts; } // of annealing
+	// lower bounds of packing: pages of max size holding the padded rects, and their area
+	inline int getPageLowerBound() const { return m_bound_pages; }
+	inline long long getPageAreaLowerBound() const { return m_bound_page_area; }
+	long long getPageArea();
 	inline std::string& getFileNamePrefix() { return m_file_prefix; }
 
 	bool saveTextures(const char* path = NULL);
@@ -267,11 +527,30 @@ private:
 	void _clearTextures();
 	void _clearImages();
 	void _clearSlices();
-	int _getMostSuitableWidth(RectArray::iterator begin, RectArray::iterator end); // calculate most suitable width
-
-	bool _insertRect(ImageRect* rect);
-	void _createTexture(int texture_width);
+	Size _getMostSuitableSize(RectArray::iterator begin, RectArray::iterator end); // calculate most suitable page size
+
+	void _findColorRects(RectArray& textured_rects);
+	void _findDuplicates(const RectArray& rects, RectArray& unique_rects);
+	void _aliasDuplicates();
+	void _searchPackStrategy(const RectArray& rects, const RectArray& opaque_rects);
+	// turns given reps a fixed plan: rects in order, 1 turned, 0 not
+	bool _packRects(RectArray& rects, RectArray& opaque_rects, 
+		const std::vector<char>* turns = NULL, const std::vector<char>* opaque_turns = NULL);
+	bool _annealPackPlan(RectArray& rects, RectArray& opaque_rects, std::vector<char>& turns, std::vector<char>& opaque_turns);
+	void _computePackBounds(const RectArray& rects, const RectArray& opaque_rects);
+	void _sortRects(RectArray& rects);
+	bool _insertRects(RectArray& rects, TextureFormat format, const std::vector<char>* turns = NULL);
+	bool _insertRect(ImageRect* rect, int turn = -1); // turn 0 or 1 forced, -1 reps the packer's choice
+	void _createTexture(Size texture_size, TextureFormat format);
+	void _shrinkTextures();
 	Slice* _findFreeSlice(Size rect_size);
+	void _addFreeSlice(Slice* slice);
+	void _removeFreeSlice(FreeSliceIndex::iterator it);
+	bool _mergeFreeSlice(Slice* slice);
+	void _clearFreeSlices();
+	Slice* _allocSlice(int texture_id);
+	void _freeSlice(Slice* slice);
+	bool _insertRectToBin(ImageRect* rect, int turn);
 
 	bool _printToTextures();
 
@@ -280,13 +559,36 @@ private:
 	RectArray m_rects;
 
 	SliceArray m_used_slices;
-	SliceArray m_free_slices;
+	FreeSliceIndex m_free_slices;	// free space of guillotine pages
+	int m_min_rect_side;			// free slices narrower take no rect left, dropped
+	CornerSliceIndex m_free_top_left;		// free slices to join with
+	CornerSliceIndex m_free_bottom_right;
+	int m_free_merge_count;
+	long long m_free_merge_area;
+	SliceArray m_alias_slices;		// slices of duplicates, sharing the zone of their master, not printed
+	SliceArray m_color_slices;		// slices of single color rects, not in textures
+	std::vector<Duplicate> m_duplicates;
 	
 	TextureArray m_textures;
+	std::vector<TextureFormat> m_texture_formats;
+	std::vector<Size> m_texture_sizes;	// textures are allocated once packing is final
+	std::vector<PackBin*> m_bins;	// free space of each page, not for guillotine
+	int m_open_texture;				// first page taking rects
 	TextureSlices m_texture_slices;
 	ImageSlices m_image_slices;
+	std::vector<Image*> m_images;
 
 	CompositorOptions m_options;
+	PackStrategy m_strategy;
+	int m_pack_attempts;
+	int m_bound_pages;
+	long long m_bound_page_area;
+
+	// slices are allocated in chunks, reused after cleared
+	std::vector<Slice*> m_slice_chunks;
+	size_t m_slice_chunk_idx;
+	int m_slice_chunk_used;
+	SliceArray m_spare_slices;
 };
 
 int test_cropper();
@@ -0,0 +1,194 @@
+#include "ictasks.h"
+#include <cassert>
+
+#if defined(_MSC_VER)
+#	define ICROPPER_THREAD_LOCAL __declspec(thread)
+#else
+#	define ICROPPER_THREAD_LOCAL __thread
+#endif
+
+namespace icropper {
+
+// scheduler & queue of the worker running on this thread
+static ICROPPER_THREAD_LOCAL TaskScheduler* s_current_scheduler = NULL;
+static ICROPPER_THREAD_LOCAL int s_current_worker = -1;
+
+//////////////////////////////////////////////////////////////////////////
+
+TaskScheduler::TaskScheduler(int threads /*= 0*/)
+: m_queued(0)
+, m_stop(false)
+{
+	if (threads <= 0)
+	{
+		threads = (int)std::thread::hardware_concurrency() - 1;
+		threads = threads < 0 ? 0 : threads;
+	}
+
+	for (int i = 0; i <= threads; i++)
+	{
+		m_queues.push_back(new Queue);
+	}
+
+	for (int i = 0; i < threads; i++)
+	{
+		m_threads.push_back(std::thread(&TaskScheduler::_workerLoop, this, i));
+	}
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	m_stop = true;
+	{
+		std::lock_guard<std::mutex> guard(m_sleep_lock);
+		m_sleep_cond.notify_all();
+	}
+
+	for (auto& t: m_threads)
+	{
+		t.join();
+	}
+	m_threads.clear();
+
+	for (auto queue: m_queues)
+	{
+		assert(queue->items.empty() && "Error: Tasks Left in Queue!");
+		delete queue;
+	}
+	m_queues.clear();
+}
+
+void TaskScheduler::_spawn(const Task& task, TaskGroup* group)
+{
+	group->m_pending++;
+
+	// workers push to their own queue, other threads share the last one
+	int queue_idx = s_current_scheduler == this ? s_current_worker : (int)m_threads.size();
+	{
+		std::lock_guard<std::mutex> guard(m_queues[queue_idx]->lock);
+		m_queues[queue_idx]->items.push_back(Item(task, group));
+	}
+	m_queued++;
+
+	// sync with a worker going to sleep, then wake one
+	{
+		std::lock_guard<std::mutex> guard(m_sleep_lock);
+	}
+	m_sleep_cond.notify_one();
+}
+
+bool TaskScheduler::_runOne()
+{
+	int self = s_current_scheduler == this ? s_current_worker : (int)m_threads.size();
+	int queue_num = (int)m_queues.size();
+
+	Item item;
+	bool found = _pop(self, item);
+	for (int i = 1; i < queue_num && !found; i++)
+	{
+		found = _steal((self + i) % queue_num, item);
+	}
+	if (!found)
+		return false;
+
+	m_queued--;
+	item.task();
+	if (--item.group->m_pending == 0)
+	{
+		// wake the thread waiting on the group, it sleeps with the workers;
+		// the group may be gone once done, so only the scheduler is touched
+		std::lock_guard<std::mutex> guard(m_sleep_lock);
+		m_sleep_cond.notify_all();
+	}
+	return true;
+}
+
+bool TaskScheduler::_pop(int queue_idx, Item& item)
+{
+	Queue* queue = m_queues[queue_idx];
+	std::lock_guard<std::mutex> guard(queue->lock);
+	if (queue->items.empty())
+		return false;
+
+	item = queue->items.back();
+	queue->items.pop_back();
+	return true;
+}
+
+bool TaskScheduler::_steal(int queue_idx, Item& item)
+{
+	Queue* queue = m_queues[queue_idx];
+	std::lock_guard<std::mutex> guard(queue->lock);
+	if (queue->items.empty())
+		return false;
+
+	item = queue->items.front();
+	queue->items.pop_front();
+	return true;
+}
+
+void TaskScheduler::_workerLoop(int idx)
+{
+	s_current_scheduler = this;
+	s_current_worker = idx;
+
+	while (!m_stop)
+	{
+		if (_runOne())
+			continue;
+
+		std::unique_lock<std::mutex> guard(m_sleep_lock);
+		if (!m_stop && m_queued == 0)
+		{
+			m_sleep_cond.wait(guard);
+		}
+	}
+
+	s_current_scheduler = NULL;
+	s_current_worker = -1;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+TaskGroup::TaskGroup(TaskScheduler* scheduler)
+: m_scheduler(scheduler)
+, m_pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+	wait();
+}
+
+void TaskGroup::spawn(const TaskScheduler::Task& task)
+{
+	if (!m_scheduler)
+	{
+		task();
+		return;
+	}
+
+	m_scheduler->_spawn(task, this);
+}
+
+void TaskGroup::wait()
+{
+	if (!m_scheduler)
+		return;
+
+	while (m_pending > 0)
+	{
+		if (m_scheduler->_runOne())
+			continue;
+
+		// nothing to run or steal: sleep until a task is spawned or the group is done
+		std::unique_lock<std::mutex> guard(m_scheduler->m_sleep_lock);
+		if (m_pending > 0 && m_scheduler->m_queued == 0)
+		{
+			m_scheduler->m_sleep_cond.wait(guard);
+		}
+	}
+}
+
+} // icropper
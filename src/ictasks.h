@@ -0,0 +1,87 @@
+#ifndef ICTASKS_H_
+#define ICTASKS_H_
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace icropper {
+
+class TaskGroup;
+
+//
+// Work-Stealing Task Scheduler
+//
+// every worker owns a deque: spawns push to its bottom, the owner pops
+// from the bottom (depth first), idle workers steal from the top (the
+// biggest remaining subtrees). threads waiting on a group run tasks too.
+//
+class TaskScheduler
+{
+public:
+	typedef std::function<void()> Task;
+
+	// threads: workers besides the threads waiting on groups, 0 reps hardware concurrency - 1
+	explicit TaskScheduler(int threads = 0);
+	~TaskScheduler();
+
+	inline int getThreadCount() const { return (int)m_threads.size(); }
+
+private:
+	friend class TaskGroup;
+
+	struct Item
+	{
+		Item() : group(NULL) {}
+		Item(const Task& _task, TaskGroup* _group) : task(_task), group(_group) {}
+
+		Task task;
+		TaskGroup* group;
+	};
+
+	struct Queue
+	{
+		std::mutex lock;
+		std::deque<Item> items;
+	};
+
+	void _spawn(const Task& task, TaskGroup* group);
+	bool _runOne();
+	bool _pop(int queue_idx, Item& item);
+	bool _steal(int queue_idx, Item& item);
+	void _workerLoop(int idx);
+
+	std::vector<std::thread> m_threads;
+	std::vector<Queue*> m_queues;			// one per worker, the last one for non-worker threads
+	std::atomic<int> m_queued;
+	std::atomic<bool> m_stop;
+	std::mutex m_sleep_lock;
+	std::condition_variable m_sleep_cond;
+};
+
+//
+// Tasks to wait on; without a scheduler tasks run at once
+//
+class TaskGroup
+{
+public:
+	explicit TaskGroup(TaskScheduler* scheduler);
+	~TaskGroup();
+
+	void spawn(const TaskScheduler::Task& task);
+	void wait();	// runs pending tasks of any group while waiting, sleeps when none left to run
+
+private:
+	friend class TaskScheduler;
+
+	TaskScheduler* m_scheduler;
+	std::atomic<int> m_pending;
+};
+
+} // icropper
+
+#endif
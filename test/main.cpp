@@ -1,11 +1,14 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <thread>
 
 #define GFLAGS_DLL_DECL
 #include <gflags/gflags.h>
 
 #include "icropper.h"
+#include "icalpha.h"
+#include "ictasks.h"
 
 //////////////////////////////////////////////////////////////////////////
 
@@ -22,6 +25,14 @@ DEFINE_int32(block_size, 100, "Base cropping unit in pixels.");
 DEFINE_int32(crop_min_area, 1000, "Cropping minmum area.");
 DEFINE_double(crop_max_ratio, 0.6f, "Cropping maxmum area usage.");
 DEFINE_int32(crop_max_depth, 4, "Cropping maxmum times.");
+DEFINE_bool(trim_leaves, false, "If shrink cropped rects to their non-transparent bounds.");
+DEFINE_string(split_mode, "quarter", "Splitting of blocks: quarter, 4 equal quarters; guillotine, 1 cut along the widest transparent gap; optimal, least area & quads on a cell grid.");
+DEFINE_int32(crop_cell_size, 8, "Grid cell size in pixels of optimal splitting.");
+DEFINE_int32(crop_quad_penalty, 256, "Cost of a rect in pixels of area for optimal splitting.");
+DEFINE_double(merge_growth, 0.0f, "Merge neighbor cropped rects if the area grows less than the ratio, 0 reps no merging.");
+DEFINE_int32(alpha_threshold, 0, "Pixels with alpha less or equal are taken as transparent, 0 ~ 254.");
+DEFINE_bool(alpha_clear, false, "If zero out pixels under the alpha threshold.");
+DEFINE_int32(jobs, 1, "Threads for loading & cropping images and blocks of an image, and for pack search, 0 reps using all cores.");
 
 DEFINE_bool(force_single, false, "If must pack into 1 texture.");
 DEFINE_int32(max_texture_size, 2048, "Maxmum size of texture.");
@@ -29,6 +40,17 @@ DEFINE_int32(fixed_texture_size, 0, "Use fixed texture size, default is 0, reps
 DEFINE_int32(texture_padding, 1, "Padding size for rects in texture.");
 DEFINE_bool(y_axis_up, true, "If direction of axis-y is down to top.");
 DEFINE_bool(enable_rotate, true, "If rects placed into texture enable rotate.");
+DEFINE_bool(dedupe_rects, true, "If rects of identical pixels share one place in texture.");
+DEFINE_bool(dedupe_transforms, false, "If rects mirrored or turned from others share their place too, needs flip support of runtime.");
+DEFINE_string(opaque_format, "RGBA8888", "Format of pages for fully opaque rects: RGBA8888(same pages as others), RGB888 or RGB565.");
+DEFINE_bool(color_rects, false, "If rects of a single color are written as color quads instead of into textures.");
+DEFINE_string(pack_mode, "maxrects", "Packing of rects into textures: guillotine, first fit free slice; maxrects, best fit of maximal free rects; skyline, fast for huge rect counts.");
+DEFINE_string(maxrects_heuristic, "short_side", "Free rect choice of maxrects packing: short_side, area, bottom_left or contact.");
+DEFINE_int32(pack_budget_ms, 0, "Milliseconds to improve packing by reordering & turning rects, 0 reps off; results depend on machine speed.");
+DEFINE_bool(pack_search, false, "If try packing with all sort orders, pack modes, rotations & page sizes in parallel, keeping the fewest pages & best usage.");
+
+DEFINE_bool(bench_kernels, false, "Run micro-benchmark of alpha scanning kernels and exit.");
+DEFINE_bool(report, false, "Print statistics of cropping & compositing, batch tools take any output as failure.");
 
 DEFINE_string(texture_suffix, "png", "Texture file suffix.");
 DEFINE_string(xmlfile_suffix, "xml", "ICropper xml description file suffix.");
@@ -88,8 +110,31 @@ int init_options()
 	s_crop_options.min_area				= FLAGS_crop_min_area;
 	s_crop_options.crop_depth			= FLAGS_crop_max_depth;
 	s_crop_options.crop_usage_ratio		= (float)FLAGS_crop_max_ratio;
+	s_crop_options.cell_size			= FLAGS_crop_cell_size;
+	s_crop_options.quad_penalty			= FLAGS_crop_quad_penalty;
+	s_crop_options.merge_growth			= (float)FLAGS_merge_growth;
+	s_crop_options.alpha_clear			= FLAGS_alpha_clear;
+	s_crop_options.alpha_threshold		= FLAGS_alpha_threshold;
+	if (FLAGS_alpha_threshold < 0 || FLAGS_alpha_threshold > 254)
+	{
+		std::cout << "[ERR]" << "Invalid alpha threshold: " << FLAGS_alpha_threshold << std::endl;
+		return -1;
+	}
+	s_crop_options.max_rect_size		= FLAGS_max_texture_size - FLAGS_texture_padding * 2;
 	//s_crop_options.rotate_degress;
 	s_crop_options.scale_ratio			= (float)FLAGS_scale;
+	s_crop_options.trim_leaves			= FLAGS_trim_leaves;
+	if (FLAGS_split_mode == "quarter")
+		s_crop_options.split_mode		= kCropSplitQuarter;
+	else if (FLAGS_split_mode == "guillotine")
+		s_crop_options.split_mode		= kCropSplitGuillotine;
+	else if (FLAGS_split_mode == "optimal")
+		s_crop_options.split_mode		= kCropSplitOptimal;
+	else
+	{
+		std::cout << "[ERR]" << "Unknown split mode: " << FLAGS_split_mode << std::endl;
+		return -1;
+	}
 
 	//
 	// composit options
@@ -103,39 +148,140 @@ int init_options()
 	s_comp_options.force_single_texture	= FLAGS_force_single;
 	s_comp_options.flip_axis_y			= FLAGS_y_axis_up;
 	s_comp_options.enable_rotate		= FLAGS_enable_rotate;
+	s_comp_options.dedupe_rects			= FLAGS_dedupe_rects;
+	s_comp_options.dedupe_transforms	= FLAGS_dedupe_transforms;
+	s_comp_options.color_rects			= FLAGS_color_rects;
+	s_comp_options.opaque_format		= kTextureFormatNum;
+	for (int i = 0; i < kTextureFormatNum; i++)
+	{
+		if (FLAGS_opaque_format == get_texture_format_name((TextureFormat)i))
+			s_comp_options.opaque_format = (TextureFormat)i;
+	}
+	if (s_comp_options.opaque_format == kTextureFormatNum)
+	{
+		std::cout << "[ERR]" << "Unknown opaque page format: " << FLAGS_opaque_format << std::endl;
+		return -1;
+	}
+	s_comp_options.pack_mode			= kPackModeNum;
+	for (int i = 0; i < kPackModeNum; i++)
+	{
+		if (FLAGS_pack_mode == get_pack_mode_name((PackMode)i))
+			s_comp_options.pack_mode = (PackMode)i;
+	}
+	if (s_comp_options.pack_mode == kPackModeNum)
+	{
+		std::cout << "[ERR]" << "Unknown pack mode: " << FLAGS_pack_mode << std::endl;
+		return -1;
+	}
+	s_comp_options.pack_search			= FLAGS_pack_search;
+	s_comp_options.pack_budget_ms		= FLAGS_pack_budget_ms;
+	s_comp_options.maxrects_heuristic	= kMaxRectsHeuristicNum;
+	for (int i = 0; i < kMaxRectsHeuristicNum; i++)
+	{
+		if (FLAGS_maxrects_heuristic == get_maxrects_heuristic_name((MaxRectsHeuristic)i))
+			s_comp_options.maxrects_heuristic = (MaxRectsHeuristic)i;
+	}
+	if (s_comp_options.maxrects_heuristic == kMaxRectsHeuristicNum)
+	{
+		std::cout << "[ERR]" << "Unknown maxrects heuristic: " << FLAGS_maxrects_heuristic << std::endl;
+		return -1;
+	}
 	
 	return 0;
 }
 
 
+struct CropTask
+{
+	CropTask() : image(NULL), open_failed(false) {}
+
+	std::string file;
+	Image* image;
+	bool open_failed;
+};
+
+// load, rescale & crop one file; no shared state between tasks
+void crop_file(CropTask& task)
+{
+	Image* image = Image::createWithFileName(task.file.c_str(), FLAGS_src_path.c_str());
+	if (!image)
+	{
+		task.open_failed = true;
+		return;
+	}
+
+	image->getOptions() = s_crop_options;
+
+	bool retv = image->crop();
+	image->getOptions().scheduler = NULL;
+	if (retv)
+	{
+		task.image = image;
+	}
+	else
+	{
+		delete image;
+	}
+}
+
 int crop_images()
 {
 	std::vector<std::string> files = split_str(FLAGS_src_files, " ");
 	//for (auto s: files) std::cout << "[" << s << "]" << std::endl;
-	
-	for (auto f: files)
+
+	std::vector<CropTask> tasks(files.size());
+	for (size_t i = 0; i < files.size(); i++)
 	{
-		Image* image = Image::createWithFileName(f.c_str(), FLAGS_src_path.c_str());
-		if (!image)
+		tasks[i].file = files[i];
+	}
+
+	// files and blocks of a file share the scheduler, this thread works while waiting
+	int jobs = FLAGS_jobs > 0 ? FLAGS_jobs : (int)std::thread::hardware_concurrency();
+	TaskScheduler* scheduler = jobs > 1 ? new TaskScheduler(jobs - 1) : NULL;
+	s_crop_options.scheduler = scheduler;
+	{
+		TaskGroup group(scheduler);
+		for (auto& task: tasks)
 		{
-			std::cout << "[ERR]" << "Can't open file: " << FLAGS_src_path << f << std::endl;
-			return -1;
+			CropTask* crop_task = &task;
+			group.spawn([crop_task]()
+				{
+					crop_file(*crop_task);
+				}
+			);
+		}
+		group.wait();
+	}
+	s_crop_options.scheduler = NULL;
+	delete scheduler;
+
+	// collect in file order, report the first error
+	int retv = 0;
+	for (auto& task: tasks)
+	{
+		if (retv != 0)
+		{
+			delete task.image;
+			continue;
 		}
 
-		image->getOptions() = s_crop_options;
-		
-		if (image->crop())
+		if (task.open_failed)
+		{
+			std::cout << "[ERR]" << "Can't open file: " << FLAGS_src_path << task.file << std::endl;
+			retv = -1;
+		}
+		else if (!task.image)
 		{
-			s_images.push_back(image);
+			std::cout << "[ERR]" << "Cropping file failed: " << task.file << std::endl;
+			retv = -1;
 		}
 		else
 		{
-			std::cout << "[ERR]" << "Cropping file failed: " << f << std::endl;
-			return -1;
+			s_images.push_back(task.image);
 		}
 	}
 
-	return 0;
+	return retv;
 }
 
 int composit_images()
@@ -152,7 +298,15 @@ int composit_images()
 		}
 	}
 
-	if (!s_compositor.composit())
+	// pack search attempts run on as many threads as cropping
+	int jobs = FLAGS_jobs > 0 ? FLAGS_jobs : (int)std::thread::hardware_concurrency();
+	TaskScheduler* scheduler = FLAGS_pack_search && jobs > 1 ? new TaskScheduler(jobs - 1) : NULL;
+	s_compositor.getOptions().scheduler = scheduler;
+	bool composited = s_compositor.composit();
+	s_compositor.getOptions().scheduler = NULL;
+	delete scheduler;
+
+	if (!composited)
 	{
 		std::cout << "[ERR]" << "Compositing failed!" << std::endl;
 		return -1;
@@ -184,9 +338,55 @@ int save_files()
 	return 0;
 }
 
+void report()
+{
+	int cropped_total = 0, merged_total = 0;
+	for (auto image: s_images)
+	{
+		cropped_total += image->getCroppedRectCount();
+		merged_total += (int)image->getRects().size();
+		std::cout << "[INFO]" << image->getFileName() << ": quads " 
+			<< image->getCroppedRectCount() << " -> " << image->getRects().size() << std::endl;
+	}
+	std::cout << "[INFO]" << "Total quads " << cropped_total << " -> " << merged_total 
+		<< ", duplicates " << s_compositor.getDuplicateCount() 
+		<< ", color quads " << s_compositor.getColorRectCount() << std::endl;
+	std::cout << "[INFO]" << "Textures " << s_compositor.getTextures().size() 
+		<< ", usage " << int(s_compositor.getUsageRatio() * 100 + 0.5f) << "%" << std::endl;
+	// rects fill the lower bound of page area at best
+	long long page_area = s_compositor.getPageArea();
+	long long page_area_bound = s_compositor.getPageAreaLowerBound();
+	double rect_area = s_compositor.getUsageRatio() * page_area;
+	std::cout << "[INFO]" << "Page area " << page_area << ", lower bound " << page_area_bound 
+		<< " (usage <= " << int(page_area_bound > 0 ? rect_area * 100 / page_area_bound + 0.5 : 0) << "%)"
+		<< ", pages " << s_compositor.getTextures().size() << " >= " << s_compositor.getPageLowerBound() << std::endl;
+	if (s_comp_options.pack_budget_ms > 0)
+	{
+		std::cout << "[INFO]" << "Pack attempts " << s_compositor.getPackAttemptCount() 
+			<< " in " << s_comp_options.pack_budget_ms << "ms" << std::endl;
+	}
+	if (s_comp_options.pack_search)
+	{
+		const PackStrategy& strategy = s_compositor.getPackStrategy();
+		std::cout << "[INFO]" << "Pack strategy: sort " << get_rect_sort_key_name(strategy.sort_key) 
+			<< ", " << get_pack_mode_name(strategy.pack_mode);
+		if (strategy.pack_mode == kPackMaxRects)
+			std::cout << " " << get_maxrects_heuristic_name(strategy.maxrects_heuristic);
+		std::cout << ", rotate " << strategy.enable_rotate << ", page scale " << strategy.page_scale << std::endl;
+	}
+	if (s_compositor.getPackStrategy().pack_mode == kPackGuillotine)
+	{
+		std::cout << "[INFO]" << "Free slices joined " << s_compositor.getFreeMergeCount() 
+			<< ", area recovered " << s_compositor.getFreeMergeArea() << std::endl;
+	}
+}
+
 int main(int argc, char** argv)
 {
 	google::ParseCommandLineFlags(&argc, &argv, true); 
+
+	if (FLAGS_bench_kernels)
+		return bench_alpha_kernels(2048, 2048, (BYTE)FLAGS_alpha_threshold);
 	
 	if (init_options())
 		return -1;
@@ -200,5 +400,8 @@ int main(int argc, char** argv)
 	if (save_files())
 		return -1;
 
+	if (FLAGS_report)
+		report();
+
 	return 0;
 }
\ No newline at end of file
@@ -19,7 +19,23 @@ default_config = { \
 "crop_max_depth":4, \
 "crop_max_ratio":0.6, \
 "crop_min_area":1000, \
+"trim_leaves":False, \
+"split_mode":"quarter", \
+"crop_cell_size":8, \
+"crop_quad_penalty":256, \
+"merge_growth":0, \
+"alpha_threshold":0, \
+"alpha_clear":False, \
+"jobs":1, \
 "enable_rotate":True, \
+"dedupe_rects":True, \
+"dedupe_transforms":False, \
+"color_rects":False, \
+"opaque_format":"RGBA8888", \
+"pack_mode":"maxrects", \
+"maxrects_heuristic":"short_side", \
+"pack_search":False, \
+"pack_budget_ms":0, \
 "fixed_texture_size":0, \
 "force_single":False, \
 "max_texture_size":2048, \
@@ -94,8 +110,40 @@ def read_config():
             read_config["crop_max_ratio"] = float(parser["OPTIONS"]["crop_max_ratio"])
         if parser.has_option("OPTIONS", "crop_min_area"):
             read_config["crop_min_area"] = int(parser["OPTIONS"]["crop_min_area"])
+        if parser.has_option("OPTIONS", "trim_leaves"):
+            read_config["trim_leaves"] = to_bool(parser["OPTIONS"]["trim_leaves"])
+        if parser.has_option("OPTIONS", "split_mode"):
+            read_config["split_mode"] = parser["OPTIONS"]["split_mode"]
+        if parser.has_option("OPTIONS", "crop_cell_size"):
+            read_config["crop_cell_size"] = int(parser["OPTIONS"]["crop_cell_size"])
+        if parser.has_option("OPTIONS", "crop_quad_penalty"):
+            read_config["crop_quad_penalty"] = int(parser["OPTIONS"]["crop_quad_penalty"])
+        if parser.has_option("OPTIONS", "merge_growth"):
+            read_config["merge_growth"] = float(parser["OPTIONS"]["merge_growth"])
+        if parser.has_option("OPTIONS", "alpha_threshold"):
+            read_config["alpha_threshold"] = int(parser["OPTIONS"]["alpha_threshold"])
+        if parser.has_option("OPTIONS", "alpha_clear"):
+            read_config["alpha_clear"] = to_bool(parser["OPTIONS"]["alpha_clear"])
+        if parser.has_option("OPTIONS", "jobs"):
+            read_config["jobs"] = int(parser["OPTIONS"]["jobs"])
         if parser.has_option("OPTIONS", "enable_rotate"):
             read_config["enable_rotate"] = to_bool(parser["OPTIONS"]["enable_rotate"])
+        if parser.has_option("OPTIONS", "dedupe_rects"):
+            read_config["dedupe_rects"] = to_bool(parser["OPTIONS"]["dedupe_rects"])
+        if parser.has_option("OPTIONS", "dedupe_transforms"):
+            read_config["dedupe_transforms"] = to_bool(parser["OPTIONS"]["dedupe_transforms"])
+        if parser.has_option("OPTIONS", "color_rects"):
+            read_config["color_rects"] = to_bool(parser["OPTIONS"]["color_rects"])
+        if parser.has_option("OPTIONS", "opaque_format"):
+            read_config["opaque_format"] = parser["OPTIONS"]["opaque_format"]
+        if parser.has_option("OPTIONS", "pack_mode"):
+            read_config["pack_mode"] = parser["OPTIONS"]["pack_mode"]
+        if parser.has_option("OPTIONS", "maxrects_heuristic"):
+            read_config["maxrects_heuristic"] = parser["OPTIONS"]["maxrects_heuristic"]
+        if parser.has_option("OPTIONS", "pack_search"):
+            read_config["pack_search"] = to_bool(parser["OPTIONS"]["pack_search"])
+        if parser.has_option("OPTIONS", "pack_budget_ms"):
+            read_config["pack_budget_ms"] = int(parser["OPTIONS"]["pack_budget_ms"])
         if parser.has_option("OPTIONS", "fixed_texture_size"):
             read_config["fixed_texture_size"] = int(parser["OPTIONS"]["fixed_texture_size"])
         if parser.has_option("OPTIONS", "force_single"):